@@ -6,28 +6,32 @@ uniform sampler2D norm_tex;
 //Texture Transparency
 uniform float transparency;
 
-//Point Light
-uniform vec3 lightPos;
-uniform vec3 lightColor;
-uniform float lightLumens;
-
-uniform float ambientStr;
-uniform vec3 ambientColor;
-
-uniform vec3 cameraPos;
-uniform float specStr;
-uniform float specPhong;
-
-//Direction Light
-uniform vec3 dirLightDirection;
-uniform vec3 dirLightColor;
-uniform float dirLightLumens;
-
-uniform float dirAmbientStr;
-uniform vec3 dirAmbientColor;
-
-uniform float dirSpecStr;
-uniform float dirSpecPhong;
+//Per frame camera data (std140, binding point 0), shared by every shader
+layout(std140) uniform FrameData {
+	mat4 view;
+	mat4 projection;
+	vec4 cameraPos;
+};
+
+//Per frame light data (std140, binding point 1), shared by every lit shader
+//params = lumens, ambient strength, specular strength, specular phong
+struct PointLight {
+	vec4 position;
+	vec4 color;
+	vec4 ambientColor;
+	vec4 params;
+};
+
+layout(std140) uniform LightData {
+	PointLight pointLights[4];
+	vec4 dirLightDirection;
+	vec4 dirLightColor;
+	vec4 dirAmbientColor;
+	vec4 dirLightParams;
+};
+
+//Which of the point lights lights this model
+uniform int pointLightIndex;
 
 in vec2 texCoord;
 in vec3 normCoord;
@@ -36,6 +40,23 @@ in vec3 fragPos;
 out vec4 FragColor;
 
 void main(){
+	//Point Light
+	PointLight pointLight = pointLights[pointLightIndex];
+	vec3 lightPos = pointLight.position.xyz;
+	vec3 lightColor = pointLight.color.rgb;
+	float lightLumens = pointLight.params.x;
+	float ambientStr = pointLight.params.y;
+	vec3 ambientColor = pointLight.ambientColor.rgb;
+	float specStr = pointLight.params.z;
+	float specPhong = pointLight.params.w;
+
+	//Direction Light
+	float dirLightLumens = dirLightParams.x;
+	float dirAmbientStr = dirLightParams.y;
+	float dirSpecStr = dirLightParams.z;
+	//The directional highlight uses the point light's phong exponent, dirLightParams.w is not read
+	float dirSpecPhong = specPhong;
+
 	vec4 pixelColor=texture(tex, texCoord);
 	pixelColor.a=transparency;
 	//Alpha Cut off Shader
@@ -58,23 +79,23 @@ void main(){
 
 	vec3 ambientCol = ambientColor * ambientStr;
 
-	vec3 viewDir = normalize(cameraPos - fragPos);
+	vec3 viewDir = normalize(cameraPos.xyz - fragPos);
 	vec3 reflectDir = reflect(-lightDir, normal);
 	float spec = pow(max(dot(reflectDir, viewDir), 0.1), specPhong);
 	vec3 specColor = spec* specStr * lightColor;
 	vec4 pointLightVal = vec4(specColor + diffuse + ambientCol, 1.0) * apparentBrightness;
 
-	vec3 dirLightDir = normalize(dirLightDirection);
+	vec3 dirLightDir = normalize(dirLightDirection.xyz);
 
 	float dirLightDiff = max(dot(normal, dirLightDir), 0.0);
-	vec3 dirLightDiffuse = dirLightDiff * dirLightColor;
+	vec3 dirLightDiffuse = dirLightDiff * dirLightColor.rgb;
 
-	vec3 dirAmbientCol = dirAmbientColor * dirAmbientStr;
+	vec3 dirAmbientCol = dirAmbientColor.rgb * dirAmbientStr;
 
-	vec3 dirViewDir = normalize(cameraPos - fragPos);
+	vec3 dirViewDir = normalize(cameraPos.xyz - fragPos);
 	vec3 dirReflectDir = reflect(-dirLightDir, normal);
 	float dirSpec = pow(max(dot(dirReflectDir, dirViewDir), 0.1), dirSpecPhong);
-	vec3 dirSpecColor = dirSpec* dirSpecStr * dirLightColor;
+	vec3 dirSpecColor = dirSpec* dirSpecStr * dirLightColor.rgb;
 	vec4 directionLightVal = vec4(dirSpecColor + dirLightDiffuse + dirAmbientCol, 1.0)*dirLightLumens;
 
 
@@ -9,11 +9,15 @@ layout(location = 2) in vec2 aTex;
 //Transformation matrix
 uniform mat4 transform;
 
-//Projection matrix
-uniform mat4 projection;
+//Inverse transpose of the transform's upper 3x3, computed once per model on the CPU
+uniform mat3 normalMatrix;
 
-//View matrix
-uniform mat4 view;
+//Per frame camera data (std140, binding point 0), shared by every shader
+layout(std140) uniform FrameData {
+	mat4 view;
+	mat4 projection;
+	vec4 cameraPos;
+};
 
 //Passes data to fragment shader
 out vec2 texCoord;
@@ -28,6 +32,6 @@ void main(){
 
 	texCoord = aTex;
 
-	normCoord = mat3(transpose(inverse(transform))) * vertexNormal;
+	normCoord = normalMatrix * vertexNormal;
 	fragPos = vec3(transform * vec4(aPos, 1.0));
 }
\ No newline at end of file
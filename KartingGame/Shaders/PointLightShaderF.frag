@@ -1,10 +1,27 @@
 #version 330 core
 
-uniform vec3 lightColor;
-uniform float lightLumens;
+//Per frame light data (std140, binding point 1), shared by every lit shader
+//params = lumens, ambient strength, specular strength, specular phong
+struct PointLight {
+	vec4 position;
+	vec4 color;
+	vec4 ambientColor;
+	vec4 params;
+};
+
+layout(std140) uniform LightData {
+	PointLight pointLights[4];
+	vec4 dirLightDirection;
+	vec4 dirLightColor;
+	vec4 dirAmbientColor;
+	vec4 dirLightParams;
+};
+
+//Which of the point lights lights this model
+uniform int pointLightIndex;
 
 out vec4 FragColor;
 
 void main(){
-	FragColor=vec4(lightColor,1.0f)*lightLumens;
+	FragColor=vec4(pointLights[pointLightIndex].color.rgb,1.0f)*pointLights[pointLightIndex].params.x;
 }
\ No newline at end of file
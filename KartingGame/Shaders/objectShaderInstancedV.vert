@@ -0,0 +1,38 @@
+#version 330 core
+
+layout(location = 0) in vec3 aPos;
+
+layout(location = 1) in vec3 vertexNormal;
+
+//gets data at attrib index 2
+//converts it and stores it into vec2-atext
+layout(location = 2) in vec2 aTex;
+
+//Per instance data, matrices take one location per column
+layout(location = 3) in mat4 instanceTransform;
+layout(location = 7) in mat3 instanceNormalMatrix;
+layout(location = 10) in float instanceTransparency;
+
+//Per frame camera data (std140, binding point 0), shared by every shader
+layout(std140) uniform FrameData {
+	mat4 view;
+	mat4 projection;
+	vec4 cameraPos;
+};
+
+//Passes data to fragment shader
+out vec2 texCoord;
+
+out vec3 normCoord;
+out vec3 fragPos;
+out float fragTransparency;
+
+void main(){
+	gl_Position = projection * view * instanceTransform * vec4(aPos, 1.0);
+
+	texCoord = aTex;
+
+	normCoord = instanceNormalMatrix * vertexNormal;
+	fragPos = vec3(instanceTransform * vec4(aPos, 1.0));
+	fragTransparency = instanceTransparency;
+}
\ No newline at end of file
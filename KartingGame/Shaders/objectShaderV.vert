@@ -9,11 +9,18 @@ layout(location = 2) in vec2 aTex;
 //Transformation matrix
 uniform mat4 transform;
 
-//Projection matrix
-uniform mat4 projection;
+//Inverse transpose of the transform's upper 3x3, computed once per model on the CPU
+uniform mat3 normalMatrix;
 
-//View matrix
-uniform mat4 view;
+//Texture Transparency, passed through to the fragment shader
+uniform float transparency;
+
+//Per frame camera data (std140, binding point 0), shared by every shader
+layout(std140) uniform FrameData {
+	mat4 view;
+	mat4 projection;
+	vec4 cameraPos;
+};
 
 //Passes data to fragment shader
 out vec2 texCoord;
@@ -22,12 +29,14 @@ layout(location = 1) in vec3 vertexNormal;
 
 out vec3 normCoord;
 out vec3 fragPos;
+out float fragTransparency;
 
 void main(){
 	gl_Position = projection * view * transform * vec4(aPos, 1.0);
 
 	texCoord = aTex;
 
-	normCoord = mat3(transpose(inverse(transform))) * vertexNormal;
+	normCoord = normalMatrix * vertexNormal;
 	fragPos = vec3(transform * vec4(aPos, 1.0));
+	fragTransparency = transparency;
 }
\ No newline at end of file
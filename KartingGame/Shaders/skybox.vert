@@ -4,11 +4,16 @@ layout(location =0) in vec3 aPos;
 
 out vec3 skyTexCoord;
 
-uniform mat4 projection;
-uniform mat4 view;
+//Per frame camera data (std140, binding point 0), shared by every shader
+layout(std140) uniform FrameData {
+	mat4 view;
+	mat4 projection;
+	vec4 cameraPos;
+};
 
 void main(){
 	skyTexCoord=aPos;
-	vec4 pos = projection*view*vec4(aPos,1.0);
+	//mat3 removes the position components of the view so the skybox stays centered on the camera
+	vec4 pos = projection*mat4(mat3(view))*vec4(aPos,1.0);
 	gl_Position = vec4(pos.x, pos.y, pos.w, pos.w);
 }
\ No newline at end of file
@@ -1,7 +1,59 @@
 #include <iostream>
 #include <string>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <random>
+#include <iomanip>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define KARTING_SSE
+#include <xmmintrin.h>
+#endif
+// Trace scopes read the x86 time stamp counter directly, it costs a fraction of a call to the OS clock
+#if defined(KARTING_PROFILING) && (defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__))
+#define KARTING_TRACE_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+#include <memory>
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+// Offscreen rendering through EGL, for Linux machines without a display. Needs the EGL headers and libEGL
+#ifdef KARTING_WITH_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -46,9 +98,10 @@ https://tools.wwwtyro.net/space-3d/index.html
 */
 
 int cameraMode = -1;
-bool raceStarted = false;
-bool stopCars = true;
+// Set by the space key, the race toggles its ghosts at the next sim tick
+bool stopCarsToggled = false;
 bool day = true;
+bool printRenderStats = false;
 
 float perspectiveCameraZoom = 1.5f;
 
@@ -68,7 +121,7 @@ void getUserInput(GLFWwindow* window,
     int mods) {
 
     if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
-        stopCars=!stopCars;
+        stopCarsToggled = true;
     }
     if (glfwGetKey(window, GLFW_KEY_1) == GLFW_PRESS) {
         cameraMode = 1; //Perspective Camera
@@ -85,27 +138,797 @@ void getUserInput(GLFWwindow* window,
     if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS) {
         day = false;
     }
+    if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS) {
+        printRenderStats = true;
+    }
+}
+
+// Start of the one clock every trace event is written on, taken on first use
+chrono::steady_clock::time_point traceEpoch() {
+    static const chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    return epoch;
+}
+
+// Microseconds since traceEpoch
+double traceNowUs() {
+    return chrono::duration<double, micro>(chrono::steady_clock::now() - traceEpoch()).count();
+}
+
+/* CPU tracer
+*  TRACE_SCOPE("name") times the rest of the enclosing block. When the block ends the name and both clock
+*  readings go into the calling thread's ring buffer: no lock, no allocation, no formatting, only the newest
+*  RING_SIZE scopes per thread are kept. Names must be string literals, only the pointer is stored.
+*  A thread's buffer is made the first time it traces and handed to the next new thread once it exits.
+*  Readings are raw TSC ticks where there is one, converted to trace time only when the trace is written.
+*  Without KARTING_PROFILING the macros are empty and none of this is compiled
+*/
+#ifdef KARTING_PROFILING
+class CpuTracer {
+public:
+    struct Event {
+        const char* name;
+        int64_t start, end;
+    };
+
+private:
+    // Power of two, the write index wraps with a mask
+    static const size_t RING_SIZE = 1 << 15;
+
+    struct ThreadBuffer {
+        Event events[RING_SIZE];
+        // Only the owning thread writes, the release store publishes the event before the count
+        atomic<uint64_t> written;
+        atomic<bool> owned;
+        uint32_t tid;
+        const char* name;
+    };
+
+    // Returns the buffer to the pool when its thread exits
+    struct ThreadSlot {
+        ThreadBuffer* buffer = nullptr;
+        ~ThreadSlot() {
+            if (buffer != nullptr) {
+                buffer->owned.store(false, memory_order_release);
+            }
+        }
+    };
+
+    static mutex& registryMutex() {
+        static mutex registryLock;
+        return registryLock;
+    }
+    // Buffers live until exit, so a dump still has the scopes of threads that are gone
+    static vector<ThreadBuffer*>& registry() {
+        static vector<ThreadBuffer*> buffers;
+        return buffers;
+    }
+
+    static ThreadBuffer* acquireBuffer() {
+        lock_guard<mutex> lock(registryMutex());
+        vector<ThreadBuffer*>& buffers = registry();
+        for (size_t i = 0; i < buffers.size(); i++) {
+            if (!buffers[i]->owned.load(memory_order_acquire)) {
+                buffers[i]->owned.store(true, memory_order_relaxed);
+                buffers[i]->name = "Thread";
+                return buffers[i];
+            }
+        }
+        anchor();
+        ThreadBuffer* buffer = new ThreadBuffer();
+        buffer->written.store(0, memory_order_relaxed);
+        buffer->owned.store(true, memory_order_relaxed);
+        // Below 10 is left for the GPU profiler's tracks
+        buffer->tid = 10 + (uint32_t)buffers.size();
+        buffer->name = "Thread";
+        buffers.push_back(buffer);
+        return buffer;
+    }
+
+    // The slot has a destructor, so every access to it goes through a TLS init check. The plain pointer
+    // beside it is what the per scope path reads
+    static ThreadBuffer* threadBuffer() {
+        static thread_local ThreadBuffer* cached = nullptr;
+        if (cached == nullptr) {
+            static thread_local ThreadSlot slot;
+            slot.buffer = acquireBuffer();
+            cached = slot.buffer;
+        }
+        return cached;
+    }
+
+    // A tick reading and the trace time it was taken at, the first time a thread traced
+    struct ClockAnchor {
+        int64_t ticks;
+        double traceUs;
+    };
+    static const ClockAnchor& anchor() {
+        static const ClockAnchor first = { now(), traceNowUs() };
+        return first;
+    }
+
+public:
+    static int64_t now() {
+#ifdef KARTING_TRACE_TSC
+        return (int64_t)__rdtsc();
+#else
+        return (int64_t)chrono::steady_clock::now().time_since_epoch().count();
+#endif
+    }
+
+    static void record(const char* name, int64_t start, int64_t end) {
+        ThreadBuffer* buffer = threadBuffer();
+        uint64_t index = buffer->written.load(memory_order_relaxed);
+        Event& event = buffer->events[index & (RING_SIZE - 1)];
+        event.name = name;
+        event.start = start;
+        event.end = end;
+        buffer->written.store(index + 1, memory_order_release);
+    }
+
+    // Track name in the trace, a string literal
+    static void setThreadName(const char* name) {
+        threadBuffer()->name = name;
+    }
+
+    /* Appends every buffered scope as a complete event, each starting with ",\n"
+    *  Meant for when the traced threads are quiet, a scope being written while this runs can come out torn
+    */
+    static void writeTraceEvents(ostream& out) {
+        lock_guard<mutex> lock(registryMutex());
+        vector<ThreadBuffer*>& buffers = registry();
+        if (buffers.empty()) {
+            return;
+        }
+        // The tick rate is measured between the anchor and now, which also covers the steady clock fallback
+        const ClockAnchor& start = anchor();
+        int64_t ticksNow = now();
+        double usNow = traceNowUs();
+        double ticksToUs = ticksNow != start.ticks ? (usNow - start.traceUs) / (double)(ticksNow - start.ticks) : 0.0;
+        for (size_t i = 0; i < buffers.size(); i++) {
+            const ThreadBuffer& buffer = *buffers[i];
+            out << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer.tid
+                << ", \"args\": {\"name\": \"" << buffer.name << "\"}}";
+
+            uint64_t written = buffer.written.load(memory_order_acquire);
+            uint64_t first = written > RING_SIZE ? written - RING_SIZE : 0;
+            for (uint64_t j = first; j < written; j++) {
+                const Event& event = buffer.events[j & (RING_SIZE - 1)];
+                out << ",\n  {\"name\": \"" << event.name << "\", \"cat\": \"cpu\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer.tid
+                    << ", \"ts\": " << start.traceUs + (event.start - start.ticks) * ticksToUs << ", \"dur\": " << (event.end - event.start) * ticksToUs << "}";
+            }
+        }
+    }
+};
+
+class TraceScope {
+private:
+    const char* name;
+    int64_t start;
+
+public:
+    TraceScope(const char* newName) {
+        name = newName;
+        start = CpuTracer::now();
+    }
+    ~TraceScope() {
+        CpuTracer::record(name, start, CpuTracer::now());
+    }
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_THREAD_NAME(name) CpuTracer::setThreadName(name)
+#else
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+#endif
+
+// Gets the size and last modified time of a file, used as the key for the asset caches
+bool getFileStamp(string filePath, uint64_t& fileSize, int64_t& modifiedTime) {
+#ifdef _WIN32
+    struct _stat64 fileInfo;
+    if (_stat64(filePath.c_str(), &fileInfo) != 0) {
+        return false;
+    }
+#else
+    struct stat fileInfo;
+    if (stat(filePath.c_str(), &fileInfo) != 0) {
+        return false;
+    }
+#endif
+    fileSize = (uint64_t)fileInfo.st_size;
+    modifiedTime = (int64_t)fileInfo.st_mtime;
+    return true;
+}
+
+// Read-only memory mapping of a whole file. The OS pages the data in on demand, so nothing is copied or parsed
+class MappedFile {
+private:
+    const unsigned char* data;
+    size_t fileSize;
+#ifdef _WIN32
+    HANDLE fileHandle, mappingHandle;
+#else
+    int fileDescriptor;
+#endif
+
+public:
+    MappedFile(string filePath) {
+        data = nullptr;
+        fileSize = 0;
+#ifdef _WIN32
+        mappingHandle = NULL;
+        fileHandle = CreateFileA(filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (fileHandle == INVALID_HANDLE_VALUE) {
+            return;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(fileHandle, &size) || size.QuadPart == 0) {
+            return;
+        }
+        mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mappingHandle == NULL) {
+            return;
+        }
+        data = (const unsigned char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+        if (data != nullptr) {
+            fileSize = (size_t)size.QuadPart;
+        }
+#else
+        fileDescriptor = open(filePath.c_str(), O_RDONLY);
+        if (fileDescriptor < 0) {
+            return;
+        }
+        struct stat fileInfo;
+        if (fstat(fileDescriptor, &fileInfo) != 0 || fileInfo.st_size == 0) {
+            return;
+        }
+        void* mapping = mmap(nullptr, (size_t)fileInfo.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (mapping != MAP_FAILED) {
+            data = (const unsigned char*)mapping;
+            fileSize = (size_t)fileInfo.st_size;
+        }
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data != nullptr) {
+            UnmapViewOfFile(data);
+        }
+        if (mappingHandle != NULL) {
+            CloseHandle(mappingHandle);
+        }
+        if (fileHandle != INVALID_HANDLE_VALUE) {
+            CloseHandle(fileHandle);
+        }
+#else
+        if (data != nullptr) {
+            munmap((void*)data, fileSize);
+        }
+        if (fileDescriptor >= 0) {
+            close(fileDescriptor);
+        }
+#endif
+    }
+
+    bool isOpen() {
+        return data != nullptr;
+    }
+    const unsigned char* getData() {
+        return data;
+    }
+    size_t getSize() {
+        return fileSize;
+    }
+};
+
+/* Vertex welding
+*  OBJ faces index position, normal and uv separately, so expanding them gives a triangle soup where
+*  shared corners are duplicated. Welding hashes each interleaved vertex and keeps only the unique ones
+*/
+struct WeldVertex {
+    GLfloat data[8];
+
+    bool operator==(const WeldVertex& other) const {
+        return memcmp(data, other.data, sizeof(data)) == 0;
+    }
+};
+
+struct WeldVertexHash {
+    size_t operator()(const WeldVertex& vertex) const {
+        uint32_t bits[8];
+        memcpy(bits, vertex.data, sizeof(bits));
+        size_t hash = 2166136261u;
+        for (int i = 0; i < 8; i++) {
+            hash = (hash ^ bits[i]) * 16777619u;
+        }
+        return hash;
+    }
+};
+
+void weldVertices(const vector<GLfloat>& soupVertexData, vector<GLfloat>& uniqueVertexData, vector<GLuint>& indices) {
+    size_t soupVertexCount = soupVertexData.size() / 8;
+    unordered_map<WeldVertex, GLuint, WeldVertexHash> uniqueVertices;
+    uniqueVertices.reserve(soupVertexCount);
+
+    uniqueVertexData.clear();
+    indices.clear();
+    indices.reserve(soupVertexCount);
+
+    for (size_t i = 0; i < soupVertexCount; i++) {
+        WeldVertex vertex;
+        memcpy(vertex.data, &soupVertexData[i * 8], sizeof(vertex.data));
+
+        auto inserted = uniqueVertices.insert(make_pair(vertex, (GLuint)(uniqueVertexData.size() / 8)));
+        if (inserted.second) {
+            uniqueVertexData.insert(uniqueVertexData.end(), vertex.data, vertex.data + 8);
+        }
+        indices.push_back(inserted.first->second);
+    }
+}
+
+/* Mesh optimization
+*  Runs once at load, after welding, and the result is stored in the mesh cache:
+*  1. Triangles are reordered for the post-transform vertex cache (Forsyth)
+*  2. Optionally, triangles are grouped into clusters that get sorted outward-facing first to reduce overdraw
+*  3. Vertices are reordered in first-use order so vertex fetch walks the VBO linearly
+*/
+struct VertexCacheStats {
+    float acmr; // Average cache miss ratio, transformed vertices per triangle (0.5 to 3.0)
+    float atvr; // Average transformed vertex ratio, transformed vertices per unique vertex (1.0 is ideal)
+};
+
+// Simulates a FIFO post-transform cache, which is what most GPUs behave like
+VertexCacheStats analyzeVertexCache(const GLuint* indices, size_t indexCount, size_t vertexCount, int cacheSize = 16) {
+    VertexCacheStats stats = { 0.0f, 0.0f };
+    if (indexCount < 3 || vertexCount == 0) {
+        return stats;
+    }
+
+    vector<int> cacheTimestamp(vertexCount, -cacheSize - 1);
+    int fifoTime = 0;
+    size_t misses = 0;
+    for (size_t i = 0; i < indexCount; i++) {
+        GLuint vertex = indices[i];
+        if (fifoTime - cacheTimestamp[vertex] > cacheSize) {
+            cacheTimestamp[vertex] = fifoTime;
+            fifoTime++;
+            misses++;
+        }
+    }
+    stats.acmr = (float)misses / (indexCount / 3);
+    stats.atvr = (float)misses / vertexCount;
+    return stats;
+}
+
+// Forsyth, "Linear-Speed Vertex Cache Optimisation"
+const int FORSYTH_CACHE_SIZE = 32;
+
+float forsythVertexScore(int cachePosition, int remainingValence) {
+    if (remainingValence == 0) {
+        return -1.0f;
+    }
+    float score = 0.0f;
+    if (cachePosition >= 0) {
+        if (cachePosition < 3) {
+            // The last triangle's vertices get a fixed score so the next triangle does not just reuse them
+            score = 0.75f;
+        }
+        else {
+            score = pow(1.0f - (float)(cachePosition - 3) / (FORSYTH_CACHE_SIZE - 3), 1.5f);
+        }
+    }
+    // Vertices with few triangles left get boosted so they are finished off and leave the cache
+    score += 2.0f * pow((float)remainingValence, -0.5f);
+    return score;
+}
+
+void optimizeVertexCache(vector<GLuint>& indices, size_t vertexCount) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) {
+        return;
+    }
+
+    // Vertex -> triangle adjacency
+    vector<int> valence(vertexCount, 0);
+    for (size_t i = 0; i < indices.size(); i++) {
+        valence[indices[i]]++;
+    }
+    vector<int> adjacencyOffset(vertexCount + 1, 0);
+    for (size_t v = 0; v < vertexCount; v++) {
+        adjacencyOffset[v + 1] = adjacencyOffset[v] + valence[v];
+    }
+    vector<int> adjacency(indices.size());
+    vector<int> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++) {
+        adjacency[fill[indices[i]]++] = (int)(i / 3);
+    }
+
+    vector<int> remainingValence = valence;
+    vector<int> cachePosition(vertexCount, -1);
+    vector<float> vertexScore(vertexCount);
+    for (size_t v = 0; v < vertexCount; v++) {
+        vertexScore[v] = forsythVertexScore(-1, remainingValence[v]);
+    }
+
+    vector<bool> triangleAdded(triangleCount, false);
+    vector<float> triangleScore(triangleCount);
+    for (size_t t = 0; t < triangleCount; t++) {
+        triangleScore[t] = vertexScore[indices[t * 3]] + vertexScore[indices[t * 3 + 1]] + vertexScore[indices[t * 3 + 2]];
+    }
+
+    vector<GLuint> optimizedIndices;
+    optimizedIndices.reserve(indices.size());
+    vector<int> cache, nextCache;
+    size_t scanCursor = 0;
+
+    int bestTriangle = -1;
+    while (optimizedIndices.size() < indices.size()) {
+        // Only the triangles touching the cache change score, so the best one is searched there first
+        if (bestTriangle < 0) {
+            float bestScore = -1.0f;
+            for (size_t c = 0; c < cache.size(); c++) {
+                int vertex = cache[c];
+                for (int a = adjacencyOffset[vertex]; a < adjacencyOffset[vertex + 1]; a++) {
+                    int triangle = adjacency[a];
+                    if (!triangleAdded[triangle] && triangleScore[triangle] > bestScore) {
+                        bestScore = triangleScore[triangle];
+                        bestTriangle = triangle;
+                    }
+                }
+            }
+        }
+        // Nothing in the cache is usable, continue from the first triangle that is left
+        if (bestTriangle < 0) {
+            while (triangleAdded[scanCursor]) {
+                scanCursor++;
+            }
+            bestTriangle = (int)scanCursor;
+        }
+
+        triangleAdded[bestTriangle] = true;
+        nextCache.clear();
+        for (int k = 0; k < 3; k++) {
+            GLuint vertex = indices[bestTriangle * 3 + k];
+            optimizedIndices.push_back(vertex);
+            remainingValence[vertex]--;
+            nextCache.push_back((int)vertex);
+        }
+        for (size_t c = 0; c < cache.size(); c++) {
+            int vertex = cache[c];
+            if (vertex != nextCache[0] && vertex != nextCache[1] && vertex != nextCache[2]) {
+                nextCache.push_back(vertex);
+            }
+        }
+
+        // Vertices pushed out of the LRU cache lose their cache score
+        for (size_t c = FORSYTH_CACHE_SIZE; c < nextCache.size(); c++) {
+            cachePosition[nextCache[c]] = -1;
+            vertexScore[nextCache[c]] = forsythVertexScore(-1, remainingValence[nextCache[c]]);
+        }
+        if (nextCache.size() > FORSYTH_CACHE_SIZE) {
+            nextCache.resize(FORSYTH_CACHE_SIZE);
+        }
+        for (size_t c = 0; c < nextCache.size(); c++) {
+            cachePosition[nextCache[c]] = (int)c;
+            vertexScore[nextCache[c]] = forsythVertexScore((int)c, remainingValence[nextCache[c]]);
+        }
+        cache.swap(nextCache);
+
+        // Rescore the triangles touching the cache and remember the best one for the next step
+        bestTriangle = -1;
+        float bestScore = -1.0f;
+        for (size_t c = 0; c < cache.size(); c++) {
+            int vertex = cache[c];
+            for (int a = adjacencyOffset[vertex]; a < adjacencyOffset[vertex + 1]; a++) {
+                int triangle = adjacency[a];
+                if (triangleAdded[triangle]) {
+                    continue;
+                }
+                triangleScore[triangle] = vertexScore[indices[triangle * 3]] + vertexScore[indices[triangle * 3 + 1]] + vertexScore[indices[triangle * 3 + 2]];
+                if (triangleScore[triangle] > bestScore) {
+                    bestScore = triangleScore[triangle];
+                    bestTriangle = triangle;
+                }
+            }
+        }
+    }
+    indices.swap(optimizedIndices);
+}
+
+/* Overdraw sort (Sander et al., "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw")
+*  The cache-optimized order is split into clusters wherever the cache would start cold, then the clusters
+*  facing away from the mesh center are drawn first since they are the most likely to occlude the rest
+*/
+void optimizeOverdraw(vector<GLuint>& indices, const vector<GLfloat>& vertexData) {
+    size_t triangleCount = indices.size() / 3;
+    if (triangleCount == 0) {
+        return;
+    }
+
+    vec3 meshCentroid(0.0f);
+    size_t vertexCount = vertexData.size() / 8;
+    for (size_t v = 0; v < vertexCount; v++) {
+        meshCentroid += vec3(vertexData[v * 8], vertexData[v * 8 + 1], vertexData[v * 8 + 2]);
+    }
+    meshCentroid /= (float)std::max(vertexCount, (size_t)1);
+
+    // Split where a triangle misses on all three vertices
+    const int cacheSize = 16;
+    vector<int> cacheTimestamp(vertexCount, -cacheSize - 1);
+    int fifoTime = 0;
+    vector<size_t> clusterStart;
+    for (size_t t = 0; t < triangleCount; t++) {
+        int misses = 0;
+        for (int k = 0; k < 3; k++) {
+            GLuint vertex = indices[t * 3 + k];
+            if (fifoTime - cacheTimestamp[vertex] > cacheSize) {
+                cacheTimestamp[vertex] = fifoTime;
+                fifoTime++;
+                misses++;
+            }
+        }
+        if (t == 0 || misses == 3) {
+            clusterStart.push_back(t);
+        }
+    }
+    clusterStart.push_back(triangleCount);
+
+    size_t clusterCount = clusterStart.size() - 1;
+    vector<float> clusterSortKey(clusterCount);
+    for (size_t c = 0; c < clusterCount; c++) {
+        vec3 clusterCentroid(0.0f), clusterNormal(0.0f);
+        float clusterArea = 0.0f;
+        for (size_t t = clusterStart[c]; t < clusterStart[c + 1]; t++) {
+            vec3 corners[3];
+            for (int k = 0; k < 3; k++) {
+                const GLfloat* vertex = &vertexData[indices[t * 3 + k] * 8];
+                corners[k] = vec3(vertex[0], vertex[1], vertex[2]);
+            }
+            vec3 areaNormal = cross(corners[1] - corners[0], corners[2] - corners[0]);
+            float area = length(areaNormal);
+            clusterCentroid += (corners[0] + corners[1] + corners[2]) / 3.0f * area;
+            clusterNormal += areaNormal;
+            clusterArea += area;
+        }
+        if (clusterArea > 0.0f) {
+            clusterCentroid /= clusterArea;
+        }
+        float normalLength = length(clusterNormal);
+        clusterSortKey[c] = normalLength > 0.0f ? dot(clusterCentroid - meshCentroid, clusterNormal / normalLength) : 0.0f;
+    }
+
+    vector<size_t> clusterOrder(clusterCount);
+    for (size_t c = 0; c < clusterCount; c++) {
+        clusterOrder[c] = c;
+    }
+    stable_sort(clusterOrder.begin(), clusterOrder.end(), [&clusterSortKey](size_t a, size_t b) {
+        return clusterSortKey[a] > clusterSortKey[b];
+    });
+
+    vector<GLuint> sortedIndices;
+    sortedIndices.reserve(indices.size());
+    for (size_t c = 0; c < clusterCount; c++) {
+        size_t cluster = clusterOrder[c];
+        sortedIndices.insert(sortedIndices.end(), indices.begin() + clusterStart[cluster] * 3, indices.begin() + clusterStart[cluster + 1] * 3);
+    }
+    indices.swap(sortedIndices);
+}
+
+// Renumbers the vertices in the order the index buffer first uses them
+void optimizeVertexFetch(vector<GLuint>& indices, vector<GLfloat>& vertexData) {
+    size_t vertexCount = vertexData.size() / 8;
+    vector<GLuint> remap(vertexCount, UINT32_MAX);
+    vector<GLfloat> fetchOrderedData;
+    fetchOrderedData.reserve(vertexData.size());
+
+    for (size_t i = 0; i < indices.size(); i++) {
+        GLuint& vertex = indices[i];
+        if (remap[vertex] == UINT32_MAX) {
+            remap[vertex] = (GLuint)(fetchOrderedData.size() / 8);
+            fetchOrderedData.insert(fetchOrderedData.end(), vertexData.begin() + vertex * 8, vertexData.begin() + vertex * 8 + 8);
+        }
+        vertex = remap[vertex];
+    }
+    // Vertices no triangle references are dropped
+    vertexData.swap(fetchOrderedData);
 }
 
+/* Binary mesh cache
+*  Layout: MeshCacheHeader | source path (padded to 4 bytes) | interleaved vertex data (8 floats per vertex) | indices
+*  The cache is only used when the path, size and modified time of the source OBJ still match
+*  The stored data has already been welded and optimized
+*/
+struct MeshCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceSize;
+    int64_t sourceModifiedTime;
+    uint32_t pathLength;
+    uint32_t floatCount;
+    uint32_t indexCount;
+    uint32_t optimizedOverdraw;
+    VertexCacheStats unoptimizedStats;
+};
+
+class MeshCache {
+private:
+    static const uint32_t VERSION = 3;
+    MappedFile* mappedFile;
+    const GLfloat* vertexData;
+    const GLuint* indexData;
+    uint32_t floatCount, indexCount;
+    VertexCacheStats unoptimizedStats;
+
+    static uint32_t paddedPathLength(uint32_t pathLength) {
+        return (pathLength + 3) & ~3u;
+    }
+
+public:
+    static string getCachePath(string objFilePath) {
+        return objFilePath + ".meshcache";
+    }
+
+    MeshCache(string objFilePath, bool optimizedOverdraw) {
+        mappedFile = nullptr;
+        vertexData = nullptr;
+        indexData = nullptr;
+        floatCount = 0;
+        indexCount = 0;
+
+        uint64_t sourceSize;
+        int64_t sourceModifiedTime;
+        if (!getFileStamp(objFilePath, sourceSize, sourceModifiedTime)) {
+            return;
+        }
+
+        mappedFile = new MappedFile(getCachePath(objFilePath));
+        if (!mappedFile->isOpen() || mappedFile->getSize() < sizeof(MeshCacheHeader)) {
+            return;
+        }
+
+        const MeshCacheHeader* header = (const MeshCacheHeader*)mappedFile->getData();
+        if (memcmp(header->magic, "KMSH", 4) != 0 || header->version != VERSION ||
+            header->sourceSize != sourceSize || header->sourceModifiedTime != sourceModifiedTime ||
+            header->pathLength != objFilePath.size() || header->optimizedOverdraw != (optimizedOverdraw ? 1u : 0u)) {
+            return;
+        }
+
+        const char* cachedPath = (const char*)(header + 1);
+        if (objFilePath.compare(0, string::npos, cachedPath, header->pathLength) != 0) {
+            return;
+        }
+
+        size_t vertexOffset = sizeof(MeshCacheHeader) + paddedPathLength(header->pathLength);
+        size_t indexOffset = vertexOffset + (size_t)header->floatCount * sizeof(GLfloat);
+        if (mappedFile->getSize() < indexOffset + (size_t)header->indexCount * sizeof(GLuint)) {
+            return;
+        }
+        vertexData = (const GLfloat*)(mappedFile->getData() + vertexOffset);
+        indexData = (const GLuint*)(mappedFile->getData() + indexOffset);
+        floatCount = header->floatCount;
+        indexCount = header->indexCount;
+        unoptimizedStats = header->unoptimizedStats;
+    }
+
+    ~MeshCache() {
+        delete mappedFile;
+    }
+
+    static bool write(string objFilePath, const vector<GLfloat>& vertexData, const vector<GLuint>& indices,
+        bool optimizedOverdraw, VertexCacheStats unoptimizedStats) {
+        MeshCacheHeader header;
+        memcpy(header.magic, "KMSH", 4);
+        header.version = VERSION;
+        if (!getFileStamp(objFilePath, header.sourceSize, header.sourceModifiedTime)) {
+            return false;
+        }
+        header.pathLength = (uint32_t)objFilePath.size();
+        header.floatCount = (uint32_t)vertexData.size();
+        header.indexCount = (uint32_t)indices.size();
+        header.optimizedOverdraw = optimizedOverdraw ? 1u : 0u;
+        header.unoptimizedStats = unoptimizedStats;
+
+        ofstream cacheFile(getCachePath(objFilePath), ios::binary | ios::trunc);
+        if (!cacheFile) {
+            return false;
+        }
+        const char padding[4] = { 0, 0, 0, 0 };
+        cacheFile.write((const char*)&header, sizeof(header));
+        cacheFile.write(objFilePath.c_str(), header.pathLength);
+        cacheFile.write(padding, paddedPathLength(header.pathLength) - header.pathLength);
+        cacheFile.write((const char*)vertexData.data(), vertexData.size() * sizeof(GLfloat));
+        cacheFile.write((const char*)indices.data(), indices.size() * sizeof(GLuint));
+        return cacheFile.good();
+    }
+
+    bool isValid() {
+        return vertexData != nullptr;
+    }
+    const GLfloat* getVertexData() {
+        return vertexData;
+    }
+    uint32_t getFloatCount() {
+        return floatCount;
+    }
+    const GLuint* getIndexData() {
+        return indexData;
+    }
+    uint32_t getIndexCount() {
+        return indexCount;
+    }
+    VertexCacheStats getUnoptimizedStats() {
+        return unoptimizedStats;
+    }
+};
+
+/* Per instance data for instanced draws, read by objectShaderInstancedV.vert
+*  Attribute locations 3 to 6 hold the transform's columns, 7 to 9 the normal matrix's, 10 the transparency
+*/
+struct InstanceData {
+    mat4 transform;
+    mat3 normalMatrix;
+    float transparency;
+};
+
 class VAO {
 private:
     // Mesh Data
     string path;
-    vector<tinyobj::shape_t> shapes;
-    vector<tinyobj::material_t> material;
-    string warning, error;
-    tinyobj::attrib_t attributes;
+    bool loadedFromCache;
+    VertexCacheStats unoptimizedStats, optimizedStats;
 
+    // CPU-side copy, only kept after upload when asked for (collision, debugging)
+    bool keepCPUData;
     vector<GLuint> meshIndices;
     vector<GLfloat> fullVertexData;
 
-    // VAO and VBO
-    GLuint vao, vbo;
+    // Counts survive the CPU-side copy being released
+    GLsizei vertexCount, indexCount;
+    GLsizei drawFirst, drawCount;
+
+    // Distance of the furthest vertex from the mesh origin, for collision bounds
+    float boundingRadius;
+
+    // VAO, VBO and EBO
+    GLuint vao, vbo, ebo;
+
+    // Per instance buffer, only created for meshes that are drawn instanced
+    GLuint instanceVBO = 0;
+    size_t instanceCapacity = 0;
 
 public:
-    VAO(string objFilePath) {
+    VAO(string objFilePath, bool sortForOverdraw = false, bool keepCPUMeshData = false) {
         //Initialization
         path = objFilePath;
+        keepCPUData = keepCPUMeshData;
+
+        // Cache hit: the optimized vertex and index data are mapped straight from disk, no OBJ parsing
+        MeshCache meshCache(path, sortForOverdraw);
+        if (meshCache.isValid()) {
+            loadedFromCache = true;
+            setCounts(meshCache.getFloatCount() / 8, meshCache.getIndexCount());
+            unoptimizedStats = meshCache.getUnoptimizedStats();
+            optimizedStats = analyzeVertexCache(meshCache.getIndexData(), indexCount, vertexCount);
+            if (keepCPUData) {
+                fullVertexData.assign(meshCache.getVertexData(), meshCache.getVertexData() + meshCache.getFloatCount());
+                meshIndices.assign(meshCache.getIndexData(), meshCache.getIndexData() + meshCache.getIndexCount());
+            }
+            computeBoundingRadius(meshCache.getVertexData(), meshCache.getFloatCount());
+            upload(meshCache.getVertexData(), meshCache.getFloatCount(), meshCache.getIndexData(), meshCache.getIndexCount());
+            return;
+        }
+        loadedFromCache = false;
+        unoptimizedStats = optimizedStats = { 0.0f, 0.0f };
+
+        // The OBJ data is only needed until the welded buffers are built
+        vector<tinyobj::shape_t> shapes;
+        vector<tinyobj::material_t> material;
+        string warning, error;
+        tinyobj::attrib_t attributes;
+
         bool success = tinyobj::LoadObj(
             &attributes, //Overall def
             &shapes,  //Refers to the object itself
@@ -114,33 +937,86 @@ public:
             &error,
             path.c_str()
         );
-        /* We need to instruct the EBO from the Mesh Data */
-        for (int i = 0; i < shapes[0].mesh.indices.size(); i++) {
-            meshIndices.push_back(shapes[0].mesh.indices[i].vertex_index);
+        if (!success || shapes.empty()) {
+            cout << "VAO: failed to load " << path << " : " << error << endl;
+            setCounts(0, 0);
+            boundingRadius = 0.0f;
+            upload(nullptr, 0, nullptr, 0);
+            return;
         }
 
+        // Expand every face corner into position, normal and uv, then weld the duplicates
+        vector<GLfloat> soupVertexData;
+        soupVertexData.reserve(shapes[0].mesh.indices.size() * 8);
         for (int i = 0; i < shapes[0].mesh.indices.size(); i++) {
             tinyobj::index_t vData = shapes[0].mesh.indices[i];
 
-            fullVertexData.push_back(attributes.vertices[(vData.vertex_index * 3)]);
-            fullVertexData.push_back(attributes.vertices[(vData.vertex_index * 3) + 1]);
-            fullVertexData.push_back(attributes.vertices[(vData.vertex_index * 3) + 2]);
+            soupVertexData.push_back(attributes.vertices[(vData.vertex_index * 3)]);
+            soupVertexData.push_back(attributes.vertices[(vData.vertex_index * 3) + 1]);
+            soupVertexData.push_back(attributes.vertices[(vData.vertex_index * 3) + 2]);
+
+            soupVertexData.push_back(attributes.normals[(vData.normal_index * 3)]);
+            soupVertexData.push_back(attributes.normals[(vData.normal_index * 3) + 1]);
+            soupVertexData.push_back(attributes.normals[(vData.normal_index * 3) + 2]);
+
+            soupVertexData.push_back(attributes.texcoords[(vData.texcoord_index * 2)]);
+            soupVertexData.push_back(attributes.texcoords[(vData.texcoord_index * 2) + 1]);
+        }
+        weldVertices(soupVertexData, fullVertexData, meshIndices);
+
+        unoptimizedStats = analyzeVertexCache(meshIndices.data(), meshIndices.size(), fullVertexData.size() / 8);
+        optimizeVertexCache(meshIndices, fullVertexData.size() / 8);
+        if (sortForOverdraw) {
+            optimizeOverdraw(meshIndices, fullVertexData);
+        }
+        optimizeVertexFetch(meshIndices, fullVertexData);
+        optimizedStats = analyzeVertexCache(meshIndices.data(), meshIndices.size(), fullVertexData.size() / 8);
+        setCounts(fullVertexData.size() / 8, meshIndices.size());
+
+        // Cache miss: write the optimized data so the next launch can skip parsing and optimizing
+        MeshCache::write(path, fullVertexData, meshIndices, sortForOverdraw, unoptimizedStats);
+        computeBoundingRadius(fullVertexData.data(), fullVertexData.size());
+        upload(fullVertexData.data(), fullVertexData.size(), meshIndices.data(), meshIndices.size());
+
+        if (!keepCPUData) {
+            releaseCPUData();
+        }
+    }
 
-            fullVertexData.push_back(attributes.normals[(vData.normal_index * 3)]);
-            fullVertexData.push_back(attributes.normals[(vData.normal_index * 3) + 1]);
-            fullVertexData.push_back(attributes.normals[(vData.normal_index * 3) + 2]);
+private:
+    void setCounts(size_t newVertexCount, size_t newIndexCount) {
+        vertexCount = (GLsizei)newVertexCount;
+        indexCount = (GLsizei)newIndexCount;
+        drawFirst = 0;
+        drawCount = indexCount;
+    }
 
-            fullVertexData.push_back(attributes.texcoords[(vData.texcoord_index * 2)]);
-            fullVertexData.push_back(attributes.texcoords[(vData.texcoord_index * 2) + 1]);
+    void computeBoundingRadius(const GLfloat* vertexData, size_t floatCount) {
+        float maxLengthSquared = 0.0f;
+        for (size_t i = 0; i + 2 < floatCount; i += 8) {
+            vec3 position(vertexData[i], vertexData[i + 1], vertexData[i + 2]);
+            maxLengthSquared = std::max(maxLengthSquared, dot(position, position));
         }
+        boundingRadius = sqrt(maxLengthSquared);
+    }
+
+    void releaseCPUData() {
+        vector<GLfloat>().swap(fullVertexData);
+        vector<GLuint>().swap(meshIndices);
+    }
 
-        //VAO VBO
+    void upload(const GLfloat* vertexData, size_t floatCount, const GLuint* indexData, size_t indexCount) {
+        //VAO VBO EBO
         glGenVertexArrays(1, &vao);
         glGenBuffers(1, &vbo);
+        glGenBuffers(1, &ebo);
 
         glBindVertexArray(vao);
         glBindBuffer(GL_ARRAY_BUFFER, vbo);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(GL_FLOAT) * fullVertexData.size(), fullVertexData.data(), GL_STATIC_DRAW);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GL_FLOAT) * floatCount, vertexData, GL_STATIC_DRAW);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint) * indexCount, indexData, GL_STATIC_DRAW);
 
         glVertexAttribPointer(
             0,
@@ -178,339 +1054,1364 @@ public:
         glEnableVertexAttribArray(2);
         glBindBuffer(GL_TEXTURE_2D, 2);
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        // The EBO binding is stored in the VAO, so only the VAO and VBO get unbound
         glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
 
+public:
     ~VAO() {
         glDeleteVertexArrays(1, &vao);
         glDeleteBuffers(1, &vbo);
+        glDeleteBuffers(1, &ebo);
+        if (instanceVBO != 0) {
+            glDeleteBuffers(1, &instanceVBO);
+        }
+    }
+
+    // Adds the per instance attributes to the VAO, the buffer is filled every frame by uploadInstances
+    void enableInstancing() {
+        if (instanceVBO != 0) {
+            return;
+        }
+        glGenBuffers(1, &instanceVBO);
+
+        glBindVertexArray(vao);
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+
+        // A mat4 attribute takes one location per column
+        for (GLuint column = 0; column < 4; column++) {
+            GLintptr columnPtr = offsetof(InstanceData, transform) + column * sizeof(vec4);
+            glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)columnPtr);
+            glEnableVertexAttribArray(3 + column);
+            glVertexAttribDivisor(3 + column, 1);
+        }
+
+        for (GLuint column = 0; column < 3; column++) {
+            GLintptr columnPtr = offsetof(InstanceData, normalMatrix) + column * sizeof(vec3);
+            glVertexAttribPointer(7 + column, 3, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)columnPtr);
+            glEnableVertexAttribArray(7 + column);
+            glVertexAttribDivisor(7 + column, 1);
+        }
+
+        GLintptr transparencyPtr = offsetof(InstanceData, transparency);
+        glVertexAttribPointer(10, 1, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)transparencyPtr);
+        glEnableVertexAttribArray(10);
+        glVertexAttribDivisor(10, 1);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    bool isInstanced() {
+        return instanceVBO != 0;
+    }
+
+    // Orphans the old storage so the driver doesn't wait on last frame's instanced draws
+    void uploadInstances(const InstanceData* instances, size_t count) {
+        glBindBuffer(GL_ARRAY_BUFFER, instanceVBO);
+        instanceCapacity = std::max(instanceCapacity, count);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(InstanceData) * instanceCapacity, NULL, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(InstanceData) * count, instances);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
 
     GLuint getVAO() {
         return vao;
     }
 
-    vector<GLfloat> getFullVertexData() {
+    // Empty unless the VAO was created with keepCPUMeshData
+    const vector<GLfloat>& getFullVertexData() {
         return fullVertexData;
     }
+    const vector<GLuint>& getMeshIndices() {
+        return meshIndices;
+    }
 
-};
+    GLsizei getVertexCount() {
+        return vertexCount;
+    }
+    float getBoundingRadius() {
+        return boundingRadius;
+    }
+    GLsizei getIndexCount() {
+        return indexCount;
+    }
 
-class Texture {
-private:
-    //Texture Data
-    int img_w, img_h, color_channels; //3 color channels (RGB) or 4 for RGBA
-    unsigned char* tex_bytes;
-    string texFilePath;
-    GLuint texture;
-    int texSlot;
-    
-public:
-    Texture(string textureFilePath, int newTexSlot) {
-        texSlot = newTexSlot;
-        stbi_set_flip_vertically_on_load(true);
+    size_t getCPUBytes() {
+        return fullVertexData.capacity() * sizeof(GLfloat) + meshIndices.capacity() * sizeof(GLuint);
+    }
 
-        //1st para: path of image
-        texFilePath = textureFilePath;
-        tex_bytes = stbi_load(
-            texFilePath.c_str(), // Convert string into char*
-            &img_w,
-            &img_h,
-            &color_channels, //3 for RGB and 4 for RGBA
-            0
-        );
-        glGenTextures(1, &texture);
-        switch (texSlot) {
-        case 0:
-            glActiveTexture(GL_TEXTURE0); 
-            break;
-        case 1:
-            glActiveTexture(GL_TEXTURE1);
-            break;
-        case 2:
-            glActiveTexture(GL_TEXTURE2);
-            break;
-        case 3:
-            glActiveTexture(GL_TEXTURE3);
-            break;
-        case 4:
-            glActiveTexture(GL_TEXTURE4);
-            break;
-        case 5:
-            glActiveTexture(GL_TEXTURE5);
-            break;
-        case 6:
-            glActiveTexture(GL_TEXTURE6);
-            break;
-        case 7:
-            glActiveTexture(GL_TEXTURE7);
-            break;
+    // Sub-range of the index buffer that draw calls use, the whole mesh by default
+    void setDrawRange(GLsizei newDrawFirst, GLsizei newDrawCount) {
+        drawFirst = std::min(newDrawFirst, indexCount);
+        drawCount = std::min(newDrawCount, indexCount - drawFirst);
+    }
+    GLsizei getDrawCount() {
+        return drawCount;
+    }
+    const void* getDrawOffset() {
+        return (const void*)(drawFirst * sizeof(GLuint));
+    }
+
+    // Welding and vertex cache stats: the triangle soup had one vertex per index
+    void printStats() {
+        size_t soupVertices = indexCount;
+        size_t uniqueVertices = vertexCount;
+        size_t soupBytes = soupVertices * 8 * sizeof(GLfloat);
+        size_t indexedBytes = uniqueVertices * 8 * sizeof(GLfloat) + indexCount * sizeof(GLuint);
+
+        cout << "MESH: " << path << (loadedFromCache ? " (cached)" : "")
+            << " : Vertices : " << soupVertices << " -> " << uniqueVertices;
+        if (uniqueVertices > 0) {
+            cout << " (" << (float)soupVertices / uniqueVertices << "x)";
         }
-        glBindTexture(GL_TEXTURE_2D, texture);
+        cout << " : Bytes : " << soupBytes << " -> " << indexedBytes
+            << " : ACMR : " << unoptimizedStats.acmr << " -> " << optimizedStats.acmr
+            << " : ATVR : " << unoptimizedStats.atvr << " -> " << optimizedStats.atvr
+            << " : CPU Bytes : " << getCPUBytes() << endl;
+    }
 
+};
 
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+/* Cooked texture cache
+*  Layout: TextureCacheHeader | source path (padded to 4 bytes) | TextureCacheLevel table | level data (each padded to 4 bytes)
+*  Images are cooked the first time they are loaded: decoded, given a full mip chain on the CPU, and block compressed
+*  to BC1 when they are opaque and the driver has S3TC. Later launches map the file and upload it as is, with no decode
+*  and no glGenerateMipmap. Like the mesh cache, it is only used while the source's size and modified time still match
+*/
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
+enum TextureCacheFormat {
+    KTEX_RGB8 = 0,
+    KTEX_RGBA8 = 1,
+    KTEX_BC1 = 2
+};
 
-        // If there are only 3 color channels or if it is a JPG
-        if (color_channels == 3) {
-            glTexImage2D(
-                GL_TEXTURE_2D,
-                0,
-                GL_RGB, //4 == rgba, 3 == rgb
-                img_w,
-                img_h,
-                0, //border
-                GL_RGB,
-                GL_UNSIGNED_BYTE,
-                tex_bytes
-            );
+struct TextureCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceSize;
+    int64_t sourceModifiedTime;
+    uint32_t pathLength;
+    uint32_t format;
+    uint32_t width, height;
+    uint32_t levelCount;
+    // Cook settings, a cache cooked with different ones is cooked again
+    uint32_t flipped;
+    uint32_t mipmapped;
+    uint32_t compressionAllowed;
+};
+
+// Offsets are from the start of the file
+struct TextureCacheLevel {
+    uint32_t offset, size;
+    uint32_t width, height;
+};
+
+class TextureCache {
+private:
+    static const uint32_t VERSION = 1;
+    MappedFile* mappedFile;
+    // Freshly cooked images are used straight from memory
+    vector<unsigned char> cookedFile;
+    const TextureCacheHeader* header;
+    const TextureCacheLevel* levels;
+    const unsigned char* fileData;
+
+    static uint32_t paddedLength(uint32_t length) {
+        return (length + 3) & ~3u;
+    }
+
+    // Points header and levels into the file if it is complete
+    bool attach(const unsigned char* data, size_t size) {
+        if (size < sizeof(TextureCacheHeader)) {
+            return false;
+        }
+        const TextureCacheHeader* fileHeader = (const TextureCacheHeader*)data;
+        size_t tableOffset = sizeof(TextureCacheHeader) + paddedLength(fileHeader->pathLength);
+        if (memcmp(fileHeader->magic, "KTEX", 4) != 0 || fileHeader->version != VERSION || fileHeader->levelCount == 0 ||
+            size < tableOffset + fileHeader->levelCount * sizeof(TextureCacheLevel)) {
+            return false;
+        }
+        const TextureCacheLevel* fileLevels = (const TextureCacheLevel*)(data + tableOffset);
+        for (uint32_t i = 0; i < fileHeader->levelCount; i++) {
+            if ((size_t)fileLevels[i].offset + fileLevels[i].size > size) {
+                return false;
+            }
         }
+        header = fileHeader;
+        levels = fileLevels;
+        fileData = data;
+        return true;
+    }
 
-        // if there are 4 color channels R,G,B, and A (transparency)
-        if (color_channels == 4) {
-            glTexImage2D(
-                GL_TEXTURE_2D,
-                0,
-                GL_RGBA, //4 == rgba, 3 == rgb
-                img_w,
-                img_h,
-                0, //border
-                GL_RGBA,
-                GL_UNSIGNED_BYTE,
-                tex_bytes
-            );
+    static vector<unsigned char> downsample(const vector<unsigned char>& source, int width, int height, int channels) {
+        int newWidth = std::max(1, width / 2), newHeight = std::max(1, height / 2);
+        vector<unsigned char> result((size_t)newWidth * newHeight * channels);
+        for (int y = 0; y < newHeight; y++) {
+            int y0 = std::min(y * 2, height - 1), y1 = std::min(y * 2 + 1, height - 1);
+            for (int x = 0; x < newWidth; x++) {
+                int x0 = std::min(x * 2, width - 1), x1 = std::min(x * 2 + 1, width - 1);
+                for (int c = 0; c < channels; c++) {
+                    int sum = source[((size_t)y0 * width + x0) * channels + c] + source[((size_t)y0 * width + x1) * channels + c]
+                        + source[((size_t)y1 * width + x0) * channels + c] + source[((size_t)y1 * width + x1) * channels + c];
+                    result[((size_t)y * newWidth + x) * channels + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
         }
-  
-        //Mipmap
-        glGenerateMipmap(GL_TEXTURE_2D);
-        stbi_image_free(tex_bytes);
+        return result;
     }
 
-    GLuint getTexture() {
-        return texture;
+    static uint16_t packRGB565(const unsigned char* color) {
+        return (uint16_t)(((color[0] >> 3) << 11) | ((color[1] >> 2) << 5) | (color[2] >> 3));
     }
-    int getTexSlot() {
-        return texSlot;
+    static void unpackRGB565(uint16_t packed, int* color) {
+        int r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+        color[0] = (r << 3) | (r >> 2);
+        color[1] = (g << 2) | (g >> 4);
+        color[2] = (b << 3) | (b >> 2);
     }
-};
-
-class NormalMapTexture :public Texture {
-    private:
-        string normFilePath;
-        int img_w2, img_h2, color_channels2; 
-        unsigned char* norm_bytes;
-        GLuint normTexture;
-        int normTexSlot;
-    public:
-        NormalMapTexture(string textureFilePath, int newTexSlot, string normTextureFilePath, int newNormTexSlot) :Texture(textureFilePath, newTexSlot) {
-            normTexSlot = newNormTexSlot;
-            stbi_set_flip_vertically_on_load(true);
 
-            //1st para: path of image
-            normFilePath = normTextureFilePath;
-            norm_bytes = stbi_load(
-                normFilePath.c_str(), // Convert string into char*
-                &img_w2,
-                &img_h2,
-                &color_channels2, //3 for RGB and 4 for RGBA
-                0
-            );
+    // Endpoints are the two pixels furthest apart along the block's bounding box diagonal
+    static void encodeBC1Block(const unsigned char* block, unsigned char* out) {
+        int minColor[3] = { 255, 255, 255 }, maxColor[3] = { 0, 0, 0 };
+        for (int i = 0; i < 16; i++) {
+            for (int c = 0; c < 3; c++) {
+                minColor[c] = std::min(minColor[c], (int)block[i * 3 + c]);
+                maxColor[c] = std::max(maxColor[c], (int)block[i * 3 + c]);
+            }
+        }
+        int axis[3] = { maxColor[0] - minColor[0], maxColor[1] - minColor[1], maxColor[2] - minColor[2] };
+        int lowest = 0, highest = 0, lowestDot = INT32_MAX, highestDot = INT32_MIN;
+        for (int i = 0; i < 16; i++) {
+            int projection = block[i * 3] * axis[0] + block[i * 3 + 1] * axis[1] + block[i * 3 + 2] * axis[2];
+            if (projection < lowestDot) {
+                lowestDot = projection;
+                lowest = i;
+            }
+            if (projection > highestDot) {
+                highestDot = projection;
+                highest = i;
+            }
+        }
 
+        // color0 > color1 selects the four color mode
+        uint16_t color0 = packRGB565(block + highest * 3), color1 = packRGB565(block + lowest * 3);
+        if (color0 < color1) {
+            std::swap(color0, color1);
+        }
+        uint32_t indices = 0;
+        if (color0 != color1) {
+            int palette[4][3];
+            unpackRGB565(color0, palette[0]);
+            unpackRGB565(color1, palette[1]);
+            for (int c = 0; c < 3; c++) {
+                palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+                palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+            }
+            for (int i = 0; i < 16; i++) {
+                int best = 0, bestDistance = INT32_MAX;
+                for (int p = 0; p < 4; p++) {
+                    int dr = block[i * 3] - palette[p][0], dg = block[i * 3 + 1] - palette[p][1], db = block[i * 3 + 2] - palette[p][2];
+                    int distance = dr * dr + dg * dg + db * db;
+                    if (distance < bestDistance) {
+                        bestDistance = distance;
+                        best = p;
+                    }
+                }
+                indices |= (uint32_t)best << (i * 2);
+            }
+        }
+        out[0] = (unsigned char)(color0 & 0xFF);
+        out[1] = (unsigned char)(color0 >> 8);
+        out[2] = (unsigned char)(color1 & 0xFF);
+        out[3] = (unsigned char)(color1 >> 8);
+        memcpy(out + 4, &indices, 4);
+    }
 
-            glGenTextures(1, &normTexture);
-            switch (normTexSlot) {
-            case 6:
-                glActiveTexture(GL_TEXTURE6);
-                break;
-            case 7:
-                glActiveTexture(GL_TEXTURE7);
-                break;
-            case 8:
-                glActiveTexture(GL_TEXTURE8);
-                break;
-            case 9:
-                glActiveTexture(GL_TEXTURE9);
-                break;
+    // Blocks hanging over the edge repeat the last row and column
+    static void encodeBC1(const vector<unsigned char>& rgb, int width, int height, vector<unsigned char>& out) {
+        unsigned char block[16 * 3];
+        for (int by = 0; by < height; by += 4) {
+            for (int bx = 0; bx < width; bx += 4) {
+                for (int i = 0; i < 16; i++) {
+                    int x = std::min(bx + i % 4, width - 1), y = std::min(by + i / 4, height - 1);
+                    memcpy(block + i * 3, &rgb[((size_t)y * width + x) * 3], 3);
+                }
+                size_t offset = out.size();
+                out.resize(offset + 8);
+                encodeBC1Block(block, &out[offset]);
             }
-            glBindTexture(GL_TEXTURE_2D, normTexture);
+        }
+    }
+public:
+    static string getCachePath(string imageFilePath) {
+        return imageFilePath + ".ktex";
+    }
 
-            // If there are only 3 color channels or if it is a JPG
-            if (color_channels2 == 3) {
-                glTexImage2D(
-                    GL_TEXTURE_2D,
-                    0,
-                    GL_RGB, //4 == rgba, 3 == rgb
-                    img_w2,
-                    img_h2,
-                    0, //border
-                    GL_RGB,
-                    GL_UNSIGNED_BYTE,
-                    norm_bytes
-                );
-            }
-
-            // if there are 4 color channels R,G,B, and A (transparency)
-            if (color_channels2 == 4) {
-                glTexImage2D(
-                    GL_TEXTURE_2D,
-                    0,
-                    GL_RGBA, //4 == rgba, 3 == rgb
-                    img_w2,
-                    img_h2,
-                    0, //border
-                    GL_RGBA,
-                    GL_UNSIGNED_BYTE,
-                    norm_bytes
-                );
-            }
-
-            //Mipmap
-            glGenerateMipmap(GL_TEXTURE_2D);
-            stbi_image_free(norm_bytes);
+    // Maps the cooked file for the image, isValid is false if it is missing, stale or cooked with other settings
+    TextureCache(string imageFilePath, bool flip, bool mipmaps, bool allowCompression) {
+        mappedFile = nullptr;
+        header = nullptr;
+        levels = nullptr;
+        fileData = nullptr;
+
+        uint64_t sourceSize;
+        int64_t sourceModifiedTime;
+        if (!getFileStamp(imageFilePath, sourceSize, sourceModifiedTime)) {
+            return;
+        }
+        mappedFile = new MappedFile(getCachePath(imageFilePath));
+        if (!mappedFile->isOpen() || !attach(mappedFile->getData(), mappedFile->getSize())) {
+            return;
+        }
+        const char* cachedPath = (const char*)(header + 1);
+        if (header->sourceSize != sourceSize || header->sourceModifiedTime != sourceModifiedTime ||
+            header->flipped != (flip ? 1u : 0u) || header->mipmapped != (mipmaps ? 1u : 0u) ||
+            header->compressionAllowed != (allowCompression ? 1u : 0u) || header->pathLength != imageFilePath.size() ||
+            imageFilePath.compare(0, string::npos, cachedPath, header->pathLength) != 0) {
+            header = nullptr;
         }
+    }
 
-        GLuint getNormTexture() { return normTexture; }
-        int getNormTexSlot() {return normTexSlot;}
-};
+    // Takes over a file cook just produced
+    TextureCache(vector<unsigned char>& newCookedFile) {
+        mappedFile = nullptr;
+        header = nullptr;
+        levels = nullptr;
+        fileData = nullptr;
+        cookedFile.swap(newCookedFile);
+        attach(cookedFile.data(), cookedFile.size());
+    }
 
-class Shader {
-private:
-    GLuint shaderProg, vertexShader, fragShader;
-public:
-    Shader(std::string vertFilePath, std::string fragFilePath) {
-        /* Load and create a file */
-        fstream vertSrc(vertFilePath);
-        stringstream vertBuff;
-        vertBuff << vertSrc.rdbuf();
+    ~TextureCache() {
+        delete mappedFile;
+    }
 
-        /* Convert stream into a character array */
-        string vertS = vertBuff.str();
-        const char* v = vertS.c_str();
+    // Decodes the image and builds the whole cache file in memory, safe to call from any thread
+    static bool cook(string imageFilePath, bool flip, bool mipmaps, bool allowCompression, vector<unsigned char>& file) {
+        TextureCacheHeader fileHeader;
+        memset(&fileHeader, 0, sizeof(fileHeader));
+        memcpy(fileHeader.magic, "KTEX", 4);
+        fileHeader.version = VERSION;
+        if (!getFileStamp(imageFilePath, fileHeader.sourceSize, fileHeader.sourceModifiedTime)) {
+            return false;
+        }
 
-        fstream fragSrc(fragFilePath);
-        stringstream fragBuff;
-        fragBuff << fragSrc.rdbuf();
-        string fragS = fragBuff.str();
-        const char* f = fragS.c_str();
+        // The flip flag is global in stb_image, the per thread one keeps workers from racing on it
+        stbi_set_flip_vertically_on_load_thread(flip ? 1 : 0);
+        int width, height, channels;
+        unsigned char* pixels = stbi_load(imageFilePath.c_str(), &width, &height, &channels, 0);
+        if (pixels != nullptr && channels != 3 && channels != 4) {
+            stbi_image_free(pixels);
+            pixels = stbi_load(imageFilePath.c_str(), &width, &height, &channels, 4);
+            channels = 4;
+        }
+        if (pixels == nullptr) {
+            return false;
+        }
+        size_t pixelCount = (size_t)width * height;
+        vector<unsigned char> level(pixels, pixels + pixelCount * channels);
+        stbi_image_free(pixels);
+
+        // Fully opaque images drop their alpha, which lets them be block compressed
+        if (channels == 4) {
+            bool opaque = true;
+            for (size_t i = 0; i < pixelCount && opaque; i++) {
+                opaque = level[i * 4 + 3] == 255;
+            }
+            if (opaque) {
+                for (size_t i = 0; i < pixelCount; i++) {
+                    memmove(&level[i * 3], &level[i * 4], 3);
+                }
+                level.resize(pixelCount * 3);
+                channels = 3;
+            }
+        }
+        uint32_t format = channels == 4 ? KTEX_RGBA8 : (allowCompression ? KTEX_BC1 : KTEX_RGB8);
+
+        vector<TextureCacheLevel> levelTable;
+        vector<unsigned char> levelData;
+        int levelWidth = width, levelHeight = height;
+        while (true) {
+            TextureCacheLevel entry;
+            entry.offset = (uint32_t)levelData.size();
+            entry.width = (uint32_t)levelWidth;
+            entry.height = (uint32_t)levelHeight;
+            if (format == KTEX_BC1) {
+                encodeBC1(level, levelWidth, levelHeight, levelData);
+            }
+            else {
+                levelData.insert(levelData.end(), level.begin(), level.end());
+            }
+            entry.size = (uint32_t)levelData.size() - entry.offset;
+            levelData.resize(paddedLength((uint32_t)levelData.size()));
+            levelTable.push_back(entry);
 
-        vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertexShader, 1, &v, NULL);
-        glCompileShader(vertexShader);
+            if (!mipmaps || (levelWidth == 1 && levelHeight == 1)) {
+                break;
+            }
+            level = downsample(level, levelWidth, levelHeight, channels);
+            levelWidth = std::max(1, levelWidth / 2);
+            levelHeight = std::max(1, levelHeight / 2);
+        }
 
-        /* Create a fragment shader
-        *  Assign source to fragment shader
-        *  Compile the Fragment Shader
-        */
-        fragShader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragShader, 1, &f, NULL);
-        glCompileShader(fragShader);
-            
-        /*
-        * Create the shader program
-        * Attach the compiled vertex & fragment shader
-        */
-        shaderProg = glCreateProgram();
-        glAttachShader(shaderProg, vertexShader);
-        glAttachShader(shaderProg, fragShader);
-        glLinkProgram(shaderProg);
-    }
-    void activate() {
-        glUseProgram(shaderProg);
-    }
-    GLuint getShader() {
-        return shaderProg;
+        fileHeader.pathLength = (uint32_t)imageFilePath.size();
+        fileHeader.format = format;
+        fileHeader.width = (uint32_t)width;
+        fileHeader.height = (uint32_t)height;
+        fileHeader.levelCount = (uint32_t)levelTable.size();
+        fileHeader.flipped = flip ? 1u : 0u;
+        fileHeader.mipmapped = mipmaps ? 1u : 0u;
+        fileHeader.compressionAllowed = allowCompression ? 1u : 0u;
+
+        size_t tableOffset = sizeof(TextureCacheHeader) + paddedLength(fileHeader.pathLength);
+        size_t dataOffset = tableOffset + levelTable.size() * sizeof(TextureCacheLevel);
+        for (size_t i = 0; i < levelTable.size(); i++) {
+            levelTable[i].offset += (uint32_t)dataOffset;
+        }
+        file.assign(dataOffset + levelData.size(), 0);
+        memcpy(&file[0], &fileHeader, sizeof(fileHeader));
+        memcpy(&file[sizeof(fileHeader)], imageFilePath.c_str(), fileHeader.pathLength);
+        memcpy(&file[tableOffset], levelTable.data(), levelTable.size() * sizeof(TextureCacheLevel));
+        memcpy(&file[dataOffset], levelData.data(), levelData.size());
+        return true;
     }
 
-    ~Shader() {
-        glDeleteShader(vertexShader);
-        glDeleteShader(fragShader);
+    static bool write(string imageFilePath, const vector<unsigned char>& file) {
+        ofstream cacheFile(getCachePath(imageFilePath), ios::binary | ios::trunc);
+        if (!cacheFile) {
+            return false;
+        }
+        cacheFile.write((const char*)file.data(), file.size());
+        return cacheFile.good();
     }
-};
 
-class Entity3D {
-protected:
-    vec3 pos, size, theta;
-public:
-    Entity3D() {
-        pos = vec3(0.0f);
-        size = vec3(1.0f);
-        theta = vec3(0.0f, 0.0f, 0.0f);
+    bool isValid() {
+        return header != nullptr;
     }
-    void setPosX(float newPosX) {
-        pos.x = newPosX;
+    uint32_t getFormat() {
+        return header->format;
     }
-    void setPosY(float newPosY) {
-        pos.y = newPosY;
+    uint32_t getLevelCount() {
+        return header->levelCount;
     }
-    void setPosZ(float newPosZ) {
-        pos.z = newPosZ;
+    const TextureCacheLevel& getLevel(uint32_t level) {
+        return levels[level];
     }
-    void setSize(float newSize) {
-        size = vec3(newSize, newSize, newSize);
+    const unsigned char* getFileData() {
+        return fileData;
     }
-    void setScaleX(float newScaleX) {
-        size = vec3(newScaleX, size.y, size.z);
+};
+
+/* Texture streaming
+*  Images are loaded on worker threads from their cooked cache, cooking it first on a miss, and uploaded on the
+*  main thread through a pixel buffer object, as many per frame as fit in a time budget. Every texture gets a
+*  1x1 placeholder the moment it is requested, so the scene can be drawn from the first frame and the real
+*  images pop in as they land
+*/
+class TextureStreamer {
+private:
+    // One GL texture, a 2D texture has one image and a cubemap six. It is uploaded once all of them are loaded
+    struct Request {
+        GLuint texture;
+        GLenum target;
+        vector<string> paths;
+        bool flip, mipmaps;
+        // False for images BC1 would damage, such as normal maps. Only matters when the driver has S3TC
+        bool allowCompression;
+        // Null where the image could not be loaded
+        vector<unique_ptr<TextureCache>> images;
+        size_t remaining;
+    };
+
+    struct LoadJob {
+        shared_ptr<Request> request;
+        size_t image;
+    };
+
+    vector<thread> workers;
+    mutex queueMutex;
+    condition_variable queueReady;
+    deque<LoadJob> loadQueue;
+    bool stopping = false;
+    // Set before the workers start, whether cooks may block compress
+    bool compressionAllowed = false;
+
+    // Requests with every image loaded, waiting for the main thread to upload them
+    mutex readyMutex;
+    deque<shared_ptr<Request>> readyQueue;
+    double loadMs = 0.0;
+    size_t cacheHits = 0, cooked = 0;
+
+    // Main thread only. Textures still waiting on their upload, and what finished ones take on the GPU
+    unordered_set<GLuint> pendingTextures;
+    unordered_map<GLuint, size_t> textureBytes;
+    size_t pending = 0;
+    size_t uploaded = 0;
+    size_t uploadedBytes = 0;
+    double uploadMs = 0.0;
+    chrono::steady_clock::time_point createdAt;
+    GLuint uploadPBO;
+
+    void workerLoop() {
+        TRACE_THREAD_NAME("Texture Worker");
+        while (true) {
+            LoadJob job;
+            {
+                unique_lock<mutex> lock(queueMutex);
+                queueReady.wait(lock, [this] { return stopping || !loadQueue.empty(); });
+                if (stopping) {
+                    return;
+                }
+                job = loadQueue.front();
+                loadQueue.pop_front();
+            }
+
+            TRACE_SCOPE("Texture Load");
+            auto start = chrono::steady_clock::now();
+            Request& request = *job.request;
+            const string& path = request.paths[job.image];
+            // Part of the cache key, an image cooked under the other setting is cooked again
+            bool compress = compressionAllowed && request.allowCompression;
+            unique_ptr<TextureCache> image(new TextureCache(path, request.flip, request.mipmaps, compress));
+            bool hit = image->isValid();
+            if (!hit) {
+                vector<unsigned char> cookedFile;
+                image.reset();
+                if (TextureCache::cook(path, request.flip, request.mipmaps, compress, cookedFile)) {
+                    // A read only install still gets the cooked image, it is just cooked again next launch
+                    TextureCache::write(path, cookedFile);
+                    image.reset(new TextureCache(cookedFile));
+                }
+            }
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+            lock_guard<mutex> lock(readyMutex);
+            request.images[job.image] = move(image);
+            loadMs += ms;
+            if (hit) {
+                cacheHits++;
+            }
+            else {
+                cooked++;
+            }
+            if (--request.remaining == 0) {
+                readyQueue.push_back(job.request);
+            }
+        }
     }
-    void setScaleY(float newScaleY) {
-        size = vec3(size.x, newScaleY, size.z);
+
+    void upload(Request& request) {
+        size_t bytesBefore = uploadedBytes;
+        glBindTexture(request.target, request.texture);
+        // Small mips of RGB images have rows that are not 4 byte aligned
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        GLint maxLevel = 0;
+        for (size_t i = 0; i < request.images.size(); i++) {
+            TextureCache* image = request.images[i].get();
+            if (image == nullptr || !image->isValid()) {
+                // The placeholder stays
+                cout << "TEXTURE: failed to load " << request.paths[i] << '\n';
+                continue;
+            }
+            GLenum face = request.target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)i : request.target;
+            uint32_t levelCount = image->getLevelCount();
+            const TextureCacheLevel& firstLevel = image->getLevel(0);
+            const TextureCacheLevel& lastLevel = image->getLevel(levelCount - 1);
+            size_t bytes = (size_t)lastLevel.offset + lastLevel.size - firstLevel.offset;
+            const unsigned char* levelData = image->getFileData() + firstLevel.offset;
+
+            // Every level goes into the buffer in one copy, orphaning lets the driver still read the last upload
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, uploadPBO);
+            glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+            void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+            uintptr_t base = 0;
+            if (mapped != nullptr) {
+                memcpy(mapped, levelData, bytes);
+                glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            }
+            else {
+                glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+                base = (uintptr_t)levelData;
+            }
+
+            for (uint32_t level = 0; level < levelCount; level++) {
+                const TextureCacheLevel& entry = image->getLevel(level);
+                const void* source = (const void*)(base + (entry.offset - firstLevel.offset));
+                if (image->getFormat() == KTEX_BC1) {
+                    glCompressedTexImage2D(face, level, GL_COMPRESSED_RGB_S3TC_DXT1_EXT, entry.width, entry.height, 0, entry.size, source);
+                }
+                else {
+                    GLenum format = image->getFormat() == KTEX_RGBA8 ? GL_RGBA : GL_RGB;
+                    glTexImage2D(face, level, format, entry.width, entry.height, 0, format, GL_UNSIGNED_BYTE, source);
+                }
+            }
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+            maxLevel = (GLint)levelCount - 1;
+            uploadedBytes += bytes;
+            request.images[i].reset();
+        }
+        // Without this the texture would wait for mips the cache does not have
+        glTexParameteri(request.target, GL_TEXTURE_MAX_LEVEL, maxLevel);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        glBindTexture(request.target, 0);
+
+        pendingTextures.erase(request.texture);
+        textureBytes[request.texture] = uploadedBytes - bytesBefore;
     }
-    void setScaleZ(float newScaleZ) {
-        size = vec3(size.x, size.y, newScaleZ);
+
+    static bool hasExtension(const char* extension) {
+        GLint extensionCount = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+        for (GLint i = 0; i < extensionCount; i++) {
+            const char* name = (const char*)glGetStringi(GL_EXTENSIONS, (GLuint)i);
+            if (name != nullptr && strcmp(name, extension) == 0) {
+                return true;
+            }
+        }
+        return false;
     }
-    void setThetaX(float newTheta) {
-        theta.x = newTheta;
+public:
+    TextureStreamer(unsigned int workerCount = 0) {
+        createdAt = chrono::steady_clock::now();
+        compressionAllowed = hasExtension("GL_EXT_texture_compression_s3tc");
+        if (workerCount == 0) {
+            workerCount = std::max(1u, std::min(4u, thread::hardware_concurrency()));
+        }
+        for (unsigned int i = 0; i < workerCount; i++) {
+            workers.push_back(thread(&TextureStreamer::workerLoop, this));
+        }
+        glGenBuffers(1, &uploadPBO);
     }
-    void setThetaY(float newTheta) {
-        theta.y = newTheta;
+    ~TextureStreamer() {
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueReady.notify_all();
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
+        glDeleteBuffers(1, &uploadPBO);
     }
-    void setThetaZ(float newTheta) {
-        theta.z = newTheta;
+
+    /* Gives the texture its placeholder now and queues its images for loading
+    *  target is GL_TEXTURE_2D with one path, or GL_TEXTURE_CUBE_MAP with the six faces in +X,-X,+Y,-Y,+Z,-Z order
+    *  mipmaps cooks a full mip chain, the texture's min filter has to be a mipmap one to use it
+    *  urgent requests go ahead of everything already queued
+    */
+    void request(GLuint texture, GLenum target, const vector<string>& paths, bool flip, bool mipmaps, bool urgent = false, bool allowCompression = true) {
+        const unsigned char placeholder[4] = { 128, 128, 128, 255 };
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(target, texture);
+        for (size_t i = 0; i < paths.size(); i++) {
+            GLenum face = target == GL_TEXTURE_CUBE_MAP ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + (GLenum)i : target;
+            glTexImage2D(face, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+        }
+        glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, 0);
+        glBindTexture(target, 0);
+
+        shared_ptr<Request> newRequest = make_shared<Request>();
+        newRequest->texture = texture;
+        newRequest->target = target;
+        newRequest->paths = paths;
+        newRequest->flip = flip;
+        newRequest->mipmaps = mipmaps;
+        newRequest->allowCompression = allowCompression;
+        newRequest->images.resize(paths.size());
+        newRequest->remaining = paths.size();
+        pending++;
+        pendingTextures.insert(texture);
+        textureBytes.erase(texture);
+        {
+            lock_guard<mutex> lock(queueMutex);
+            for (size_t i = 0; i < paths.size(); i++) {
+                LoadJob job = { newRequest, i };
+                if (urgent) {
+                    loadQueue.insert(loadQueue.begin() + i, job);
+                }
+                else {
+                    loadQueue.push_back(job);
+                }
+            }
+        }
+        queueReady.notify_all();
     }
-    void addThetaX(float thetaIncrement) {
-        theta.x += thetaIncrement;
+
+    // Once per frame, uploads loaded textures until budgetMs is spent. At least one goes up per call so loading always moves
+    void update(double budgetMs) {
+        if (pending == 0) {
+            return;
+        }
+        TRACE_SCOPE("Texture Uploads");
+        auto start = chrono::steady_clock::now();
+        glActiveTexture(GL_TEXTURE0);
+        while (true) {
+            shared_ptr<Request> ready;
+            {
+                lock_guard<mutex> lock(readyMutex);
+                if (readyQueue.empty()) {
+                    break;
+                }
+                ready = readyQueue.front();
+                readyQueue.pop_front();
+            }
+            upload(*ready);
+            uploaded++;
+            pending--;
+
+            double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (elapsed >= budgetMs) {
+                break;
+            }
+        }
+        uploadMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        if (pending == 0) {
+            printStats();
+        }
     }
-    void addThetaY(float thetaIncrement) {
-        theta.y += thetaIncrement;
+
+    bool isIdle() const {
+        return pending == 0;
     }
-    void addThetaZ(float thetaIncrement) {
-        theta.z += thetaIncrement;
+    bool isPending(GLuint texture) const {
+        return pendingTextures.count(texture) != 0;
     }
-    vec3 getPos() {
-        return pos;
+    // GPU bytes of an uploaded texture, 0 while it is pending
+    size_t getTextureBytes(GLuint texture) const {
+        unordered_map<GLuint, size_t>::const_iterator found = textureBytes.find(texture);
+        return found != textureBytes.end() ? found->second : 0;
     }
-    vec3 getScale() {
-        return size;
+    // For textures deleted by their owner
+    void forget(GLuint texture) {
+        textureBytes.erase(texture);
     }
-    vec3 getTheta() {
-        return theta;
+
+    void printStats() {
+        double totalLoadMs;
+        size_t hits, cooks;
+        {
+            lock_guard<mutex> lock(readyMutex);
+            totalLoadMs = loadMs;
+            hits = cacheHits;
+            cooks = cooked;
+        }
+        double sinceStart = chrono::duration<double>(chrono::steady_clock::now() - createdAt).count();
+        cout << "TEXTURES: Streamed : " << uploaded << " : Pending : " << pending
+            << " : Cache Hits : " << hits << " : Cooked : " << cooks
+            << " : GPU Bytes : " << uploadedBytes << " : BC1 : " << (compressionAllowed ? "on" : "off")
+            << " : Load : " << totalLoadMs << "ms (" << workers.size() << " workers)"
+            << " : Upload : " << uploadMs << "ms : All Ready After : " << sinceStart << "s" << endl;
     }
 };
 
-class Camera : public Entity3D { 
-protected:
-    float windowWidth, windowHeight;
-    vec3 worldUp;
-    mat4 cameraPosMatrix;
-    vec3 cameraGaze;
-    mat4 cameraOrientation, viewMatrix, projectionMatrix;
-
+class Texture {
+private:
+    string texFilePath;
+    GLuint texture;
+    int texSlot;
+    
 public:
-    Camera() {
-        //Empty Constructor
-    }
-    Camera(float newWindowWidth, float newWindowHeight) {
-        windowWidth = newWindowWidth;
-        windowHeight = newWindowHeight;
+    // The image arrives through the streamer, a placeholder is bound until then. allowCompression is off for data
+    // that is not a color, like normal maps
+    Texture(string textureFilePath, int newTexSlot, TextureStreamer& streamer, bool allowCompression = true) {
+        texSlot = newTexSlot;
+        texFilePath = textureFilePath;
 
-        worldUp = normalize(vec3(0.f, 1.f, 0.f)); //Pointing upward
+        glGenTextures(1, &texture);
+        glActiveTexture(GL_TEXTURE0 + texSlot);
+        glBindTexture(GL_TEXTURE_2D, texture);
 
-        pos = vec3(0.0f, 0.0f, 1.0f);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 
-        cameraGaze = vec3(0.0f, 0.0f, 0.0f); // Gaze is where the camera is looking. In this case 0,0,0 is the center of the Model we are looking at
+        streamer.request(texture, GL_TEXTURE_2D, vector<string>(1, texFilePath), true, true, false, allowCompression);
+    }
 
-        viewMatrix = lookAt(pos, cameraGaze, worldUp);
+    GLuint getTexture() {
+        return texture;
+    }
+    int getTexSlot() {
+        return texSlot;
+    }
+};
+
+class NormalMapTexture :public Texture {
+    private:
+        string normFilePath;
+        GLuint normTexture;
+        int normTexSlot;
+    public:
+        // Callers pass the tangent space normal map first, it is kept out of BC1 whose 5:6:5 endpoints band the lighting
+        NormalMapTexture(string textureFilePath, int newTexSlot, string normTextureFilePath, int newNormTexSlot, TextureStreamer& streamer)
+            :Texture(textureFilePath, newTexSlot, streamer, false) {
+            normTexSlot = newNormTexSlot;
+            normFilePath = normTextureFilePath;
+
+            glGenTextures(1, &normTexture);
+            glActiveTexture(GL_TEXTURE0 + normTexSlot);
+            glBindTexture(GL_TEXTURE_2D, normTexture);
+
+            streamer.request(normTexture, GL_TEXTURE_2D, vector<string>(1, normFilePath), true, true);
+        }
+
+        GLuint getNormTexture() { return normTexture; }
+        int getNormTexSlot() {return normTexSlot;}
+};
+
+// FNV-1a hash of a uniform name. Being constexpr, the names below are hashed at compile time
+constexpr uint32_t uniformHash(const char* name, uint32_t hash = 2166136261u) {
+    return *name == 0 ? hash : uniformHash(name + 1, (hash ^ (uint32_t)(unsigned char)*name) * 16777619u);
+}
+
+namespace UniformID {
+    constexpr uint32_t transform = uniformHash("transform");
+    constexpr uint32_t normalMatrix = uniformHash("normalMatrix");
+    constexpr uint32_t tex = uniformHash("tex");
+    constexpr uint32_t transparency = uniformHash("transparency");
+    constexpr uint32_t pointLightIndex = uniformHash("pointLightIndex");
+}
+
+/* Per frame uniform blocks
+*  Camera and light data are the same for every model in a frame, so they are uploaded once into
+*  std140 uniform buffers that every program reads from. The structs mirror the GLSL blocks exactly
+*/
+const GLuint FRAME_DATA_BINDING = 0;
+const GLuint LIGHT_DATA_BINDING = 1;
+const int MAX_POINT_LIGHTS = 4;
+
+struct FrameDataStd140 {
+    mat4 view;
+    mat4 projection;
+    vec4 cameraPos;
+};
+
+// params = lumens, ambient strength, specular strength, specular phong
+struct PointLightStd140 {
+    vec4 position;
+    vec4 color;
+    vec4 ambientColor;
+    vec4 params;
+};
+
+struct LightDataStd140 {
+    PointLightStd140 pointLights[MAX_POINT_LIGHTS];
+    vec4 dirLightDirection;
+    vec4 dirLightColor;
+    vec4 dirAmbientColor;
+    // Specular phong (w) is unused, the directional highlight takes the model's point light phong
+    vec4 dirLightParams;
+};
+
+static_assert(sizeof(FrameDataStd140) == 144, "FrameData must match the std140 layout");
+static_assert(sizeof(LightDataStd140) == MAX_POINT_LIGHTS * 64 + 64, "LightData must match the std140 layout");
+
+class UniformBuffer {
+private:
+    GLuint ubo;
+    GLuint bindingPoint;
+    GLsizeiptr bufferSize;
+
+public:
+    UniformBuffer(GLuint newBindingPoint, GLsizeiptr newBufferSize) {
+        bindingPoint = newBindingPoint;
+        bufferSize = newBufferSize;
+
+        glGenBuffers(1, &ubo);
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferData(GL_UNIFORM_BUFFER, bufferSize, NULL, GL_DYNAMIC_DRAW);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+    }
+    ~UniformBuffer() {
+        glDeleteBuffers(1, &ubo);
+    }
+    void update(const void* data) {
+        glBindBuffer(GL_UNIFORM_BUFFER, ubo);
+        glBufferSubData(GL_UNIFORM_BUFFER, 0, bufferSize, data);
+        glBindBuffer(GL_UNIFORM_BUFFER, 0);
+        glBindBufferBase(GL_UNIFORM_BUFFER, bindingPoint, ubo);
+    }
+};
+
+// Connects a program's uniform block to its binding point, programs without the block are skipped
+void bindUniformBlock(GLuint shaderProg, const char* blockName, GLuint bindingPoint) {
+    GLuint blockIndex = glGetUniformBlockIndex(shaderProg, blockName);
+    if (blockIndex != GL_INVALID_INDEX) {
+        glUniformBlockBinding(shaderProg, blockIndex, bindingPoint);
+    }
+}
+
+
+/* Program binary cache
+*  Layout: ProgramCacheHeader | driver binary
+*  Linked programs are saved with glGetProgramBinary and loaded back with glProgramBinary on the next launch,
+*  skipping compile and link. A cache is only used when both the GLSL sources and the driver (vendor, renderer,
+*  version) hash the same as when it was saved. The driver can still refuse a binary, then the program is
+*  built from source and the cache rewritten
+*/
+struct ProgramCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t driverHash;
+    uint32_t binaryFormat;
+    uint32_t binaryLength;
+};
+
+// 64 bit FNV-1a, continuing from hash so several strings can be chained
+uint64_t hashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+class ProgramBinaryCache {
+private:
+    static const uint32_t VERSION = 1;
+
+    static uint64_t hashGLString(GLenum name, uint64_t hash) {
+        const char* value = (const char*)glGetString(name);
+        if (value == nullptr) {
+            return hash;
+        }
+        // The terminator keeps "ab"+"c" apart from "a"+"bc"
+        return hashBytes(value, strlen(value) + 1, hash);
+    }
+
+    static string baseName(const string& filePath) {
+        size_t slash = filePath.find_last_of("/\\");
+        return slash == string::npos ? filePath : filePath.substr(slash + 1);
+    }
+public:
+    // Next to the vertex shader, named after both stages
+    static string getCachePath(const string& vertFilePath, const string& fragFilePath) {
+        return vertFilePath + "+" + baseName(fragFilePath) + ".progbin";
+    }
+
+    // Needs GL 4.1 or ARB_get_program_binary, and a driver that has at least one binary format
+    static bool isSupported() {
+        if (glProgramBinary == nullptr || glGetProgramBinary == nullptr || glProgramParameteri == nullptr) {
+            return false;
+        }
+        GLint formatCount = 0;
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+        return formatCount > 0;
+    }
+
+    static uint64_t getDriverHash() {
+        uint64_t hash = hashGLString(GL_VENDOR, hashBytes(nullptr, 0));
+        hash = hashGLString(GL_RENDERER, hash);
+        return hashGLString(GL_VERSION, hash);
+    }
+
+    // True if program now holds the cached binary and linked with it
+    static bool load(const string& cachePath, uint64_t sourceHash, uint64_t driverHash, GLuint program) {
+        MappedFile cacheFile(cachePath);
+        if (!cacheFile.isOpen() || cacheFile.getSize() < sizeof(ProgramCacheHeader)) {
+            return false;
+        }
+        const ProgramCacheHeader* header = (const ProgramCacheHeader*)cacheFile.getData();
+        if (memcmp(header->magic, "KPRG", 4) != 0 || header->version != VERSION ||
+            header->sourceHash != sourceHash || header->driverHash != driverHash ||
+            cacheFile.getSize() < sizeof(ProgramCacheHeader) + header->binaryLength) {
+            return false;
+        }
+        glProgramBinary(program, header->binaryFormat, header + 1, (GLsizei)header->binaryLength);
+        GLint linked = GL_FALSE;
+        glGetProgramiv(program, GL_LINK_STATUS, &linked);
+        return linked == GL_TRUE;
+    }
+
+    // The program must have been linked with GL_PROGRAM_BINARY_RETRIEVABLE_HINT set
+    static bool save(const string& cachePath, uint64_t sourceHash, uint64_t driverHash, GLuint program) {
+        GLint binaryLength = 0;
+        glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &binaryLength);
+        if (binaryLength <= 0) {
+            return false;
+        }
+        vector<char> binary(binaryLength);
+        GLenum binaryFormat = 0;
+        GLsizei writtenLength = 0;
+        glGetProgramBinary(program, binaryLength, &writtenLength, &binaryFormat, binary.data());
+        if (writtenLength <= 0) {
+            return false;
+        }
+
+        ProgramCacheHeader header;
+        memcpy(header.magic, "KPRG", 4);
+        header.version = VERSION;
+        header.sourceHash = sourceHash;
+        header.driverHash = driverHash;
+        header.binaryFormat = binaryFormat;
+        header.binaryLength = (uint32_t)writtenLength;
+
+        ofstream cacheFile(cachePath, ios::binary | ios::trunc);
+        if (!cacheFile) {
+            return false;
+        }
+        cacheFile.write((const char*)&header, sizeof(header));
+        cacheFile.write(binary.data(), writtenLength);
+        return cacheFile.good();
+    }
+};
+
+class Shader {
+private:
+    GLuint shaderProg, vertexShader, fragShader;
+    // Vertex shader file name without folder or extension, used to label profiler scopes
+    string name;
+
+    // Active uniforms reflected after linking, sorted by name hash. The last uploaded value is kept so
+    // setting the same value again does not reach the driver
+    struct UniformSlot {
+        uint32_t nameHash;
+        GLint location;
+        GLenum type;
+        bool hasValue;
+        unsigned char value[16 * sizeof(GLfloat)];
+    };
+    vector<UniformSlot> uniforms;
+
+    void reflectUniforms() {
+        GLint uniformCount = 0, maxNameLength = 0;
+        glGetProgramiv(shaderProg, GL_ACTIVE_UNIFORMS, &uniformCount);
+        glGetProgramiv(shaderProg, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+
+        vector<GLchar> nameBuffer(std::max(maxNameLength, 1));
+        for (GLint i = 0; i < uniformCount; i++) {
+            GLsizei nameLength = 0;
+            GLint arraySize = 0;
+            GLenum type = 0;
+            glGetActiveUniform(shaderProg, (GLuint)i, (GLsizei)nameBuffer.size(), &nameLength, &arraySize, &type, nameBuffer.data());
+            string name(nameBuffer.data(), nameLength);
+
+            // Arrays are reported as "name[0]"
+            size_t bracket = name.find('[');
+            if (bracket != string::npos) {
+                name = name.substr(0, bracket);
+            }
+
+            // Uniforms inside uniform blocks have no location
+            GLint location = glGetUniformLocation(shaderProg, name.c_str());
+            if (location < 0) {
+                continue;
+            }
+
+            UniformSlot slot;
+            slot.nameHash = uniformHash(name.c_str());
+            slot.location = location;
+            slot.type = type;
+            slot.hasValue = false;
+            memset(slot.value, 0, sizeof(slot.value));
+            uniforms.push_back(slot);
+        }
+
+        sort(uniforms.begin(), uniforms.end(), [](const UniformSlot& a, const UniformSlot& b) {
+            return a.nameHash < b.nameHash;
+        });
+        for (size_t i = 1; i < uniforms.size(); i++) {
+            if (uniforms[i].nameHash == uniforms[i - 1].nameHash) {
+                cout << "SHADER: uniform name hash collision in program " << shaderProg << endl;
+            }
+        }
+    }
+
+    UniformSlot* findUniform(uint32_t nameHash) {
+        auto found = lower_bound(uniforms.begin(), uniforms.end(), nameHash, [](const UniformSlot& slot, uint32_t hash) {
+            return slot.nameHash < hash;
+        });
+        if (found == uniforms.end() || found->nameHash != nameHash) {
+            return nullptr;
+        }
+        return &(*found);
+    }
+
+    // Returns the slot if the value differs from what the program already has, nullptr otherwise
+    UniformSlot* changedUniform(uint32_t nameHash, const void* value, size_t valueSize) {
+        UniformSlot* slot = findUniform(nameHash);
+        if (slot == nullptr) {
+            return nullptr;
+        }
+        if (slot->hasValue && memcmp(slot->value, value, valueSize) == 0) {
+            return nullptr;
+        }
+        memcpy(slot->value, value, valueSize);
+        slot->hasValue = true;
+        return slot;
+    }
+
+    void printShaderLog(GLuint shader, const string& filePath) {
+        GLint logLength = 0;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+        vector<GLchar> log(std::max(logLength, 1), 0);
+        glGetShaderInfoLog(shader, (GLsizei)log.size(), nullptr, log.data());
+        cout << "SHADER: " << filePath << " failed to compile : " << log.data() << '\n';
+    }
+
+public:
+    Shader(std::string vertFilePath, std::string fragFilePath) {
+        auto readStart = chrono::steady_clock::now();
+        /* Load and create a file */
+        fstream vertSrc(vertFilePath);
+        stringstream vertBuff;
+        vertBuff << vertSrc.rdbuf();
+
+        /* Convert stream into a character array */
+        string vertS = vertBuff.str();
+        const char* v = vertS.c_str();
+
+        fstream fragSrc(fragFilePath);
+        stringstream fragBuff;
+        fragBuff << fragSrc.rdbuf();
+        string fragS = fragBuff.str();
+        const char* f = fragS.c_str();
+
+        // Both sources with their terminators, so moving text from one stage to the other changes the hash
+        uint64_t sourceHash = hashBytes(v, vertS.size() + 1);
+        sourceHash = hashBytes(f, fragS.size() + 1, sourceHash);
+        double readMs = chrono::duration<double, milli>(chrono::steady_clock::now() - readStart).count();
+
+        vertexShader = 0;
+        fragShader = 0;
+        shaderProg = glCreateProgram();
+
+        bool cacheSupported = ProgramBinaryCache::isSupported();
+        string cachePath = ProgramBinaryCache::getCachePath(vertFilePath, fragFilePath);
+        uint64_t driverHash = cacheSupported ? ProgramBinaryCache::getDriverHash() : 0;
+
+        auto loadStart = chrono::steady_clock::now();
+        bool cacheHit = cacheSupported && ProgramBinaryCache::load(cachePath, sourceHash, driverHash, shaderProg);
+        double loadMs = chrono::duration<double, milli>(chrono::steady_clock::now() - loadStart).count();
+
+        double compileMs = 0.0, linkMs = 0.0;
+        bool cacheSaved = false;
+        if (!cacheHit) {
+            // A refused binary can leave the program in a failed link state, start over with a clean one
+            glDeleteProgram(shaderProg);
+            shaderProg = glCreateProgram();
+
+            auto compileStart = chrono::steady_clock::now();
+            vertexShader = glCreateShader(GL_VERTEX_SHADER);
+            glShaderSource(vertexShader, 1, &v, NULL);
+            glCompileShader(vertexShader);
+
+            /* Create a fragment shader
+            *  Assign source to fragment shader
+            *  Compile the Fragment Shader
+            */
+            fragShader = glCreateShader(GL_FRAGMENT_SHADER);
+            glShaderSource(fragShader, 1, &f, NULL);
+            glCompileShader(fragShader);
+
+            // Asking for the status waits for the driver, so the timing covers the whole compile
+            GLint vertCompiled = GL_FALSE, fragCompiled = GL_FALSE;
+            glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &vertCompiled);
+            glGetShaderiv(fragShader, GL_COMPILE_STATUS, &fragCompiled);
+            compileMs = chrono::duration<double, milli>(chrono::steady_clock::now() - compileStart).count();
+            if (vertCompiled != GL_TRUE) {
+                printShaderLog(vertexShader, vertFilePath);
+            }
+            if (fragCompiled != GL_TRUE) {
+                printShaderLog(fragShader, fragFilePath);
+            }
+
+            /*
+            * Create the shader program
+            * Attach the compiled vertex & fragment shader
+            */
+            auto linkStart = chrono::steady_clock::now();
+            glAttachShader(shaderProg, vertexShader);
+            glAttachShader(shaderProg, fragShader);
+            if (cacheSupported) {
+                glProgramParameteri(shaderProg, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+            }
+            glLinkProgram(shaderProg);
+            GLint linked = GL_FALSE;
+            glGetProgramiv(shaderProg, GL_LINK_STATUS, &linked);
+            linkMs = chrono::duration<double, milli>(chrono::steady_clock::now() - linkStart).count();
+
+            if (linked == GL_TRUE && cacheSupported) {
+                cacheSaved = ProgramBinaryCache::save(cachePath, sourceHash, driverHash, shaderProg);
+            }
+        }
+
+        name = vertFilePath;
+        name = name.substr(name.find_last_of("/\\") + 1);
+        name = name.substr(0, name.find('.'));
+
+        cout << "SHADER: " << vertFilePath << " + " << fragFilePath << " : Read : " << readMs << "ms";
+        if (cacheHit) {
+            cout << " : Binary Cache Hit : Load : " << loadMs << "ms" << '\n';
+        }
+        else {
+            cout << " : Compile : " << compileMs << "ms : Link : " << linkMs << "ms"
+                << " : Binary Cache : " << (!cacheSupported ? "unsupported" : (cacheSaved ? "saved" : "not saved")) << '\n';
+        }
+
+        reflectUniforms();
+        bindUniformBlock(shaderProg, "FrameData", FRAME_DATA_BINDING);
+        bindUniformBlock(shaderProg, "LightData", LIGHT_DATA_BINDING);
+    }
+    void activate() {
+        glUseProgram(shaderProg);
+    }
+    GLuint getShader() {
+        return shaderProg;
+    }
+    const string& getName() const {
+        return name;
+    }
+
+    /* Typed uniform setters, the program has to be active (activate()) when these are called
+    *  Names are passed as hashes from UniformID, uniforms the program does not use are ignored
+    */
+    void setInt(uint32_t nameHash, GLint value) {
+        UniformSlot* slot = changedUniform(nameHash, &value, sizeof(value));
+        if (slot != nullptr) {
+            glUniform1i(slot->location, value);
+        }
+    }
+    void setFloat(uint32_t nameHash, GLfloat value) {
+        UniformSlot* slot = changedUniform(nameHash, &value, sizeof(value));
+        if (slot != nullptr) {
+            glUniform1f(slot->location, value);
+        }
+    }
+    void setVec3(uint32_t nameHash, const vec3& value) {
+        UniformSlot* slot = changedUniform(nameHash, value_ptr(value), sizeof(value));
+        if (slot != nullptr) {
+            glUniform3fv(slot->location, 1, value_ptr(value));
+        }
+    }
+    void setMat3(uint32_t nameHash, const mat3& value) {
+        UniformSlot* slot = changedUniform(nameHash, value_ptr(value), sizeof(value));
+        if (slot != nullptr) {
+            glUniformMatrix3fv(slot->location, 1, GL_FALSE, value_ptr(value));
+        }
+    }
+    void setMat4(uint32_t nameHash, const mat4& value) {
+        UniformSlot* slot = changedUniform(nameHash, value_ptr(value), sizeof(value));
+        if (slot != nullptr) {
+            glUniformMatrix4fv(slot->location, 1, GL_FALSE, value_ptr(value));
+        }
+    }
+
+    ~Shader() {
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragShader);
+    }
+};
+
+class Entity3D {
+protected:
+    vec3 pos, size, theta;
+
+    // State at the previous sim tick, rendering blends from it towards the current state
+    vec3 prevPos, prevSize, prevTheta;
+    bool hasPrevState = false;
+public:
+    Entity3D() {
+        pos = vec3(0.0f);
+        size = vec3(1.0f);
+        theta = vec3(0.0f, 0.0f, 0.0f);
+    }
+    void setPosX(float newPosX) {
+        pos.x = newPosX;
+    }
+    void setPosY(float newPosY) {
+        pos.y = newPosY;
+    }
+    void setPosZ(float newPosZ) {
+        pos.z = newPosZ;
+    }
+    void setSize(float newSize) {
+        size = vec3(newSize, newSize, newSize);
+    }
+    void setScaleX(float newScaleX) {
+        size = vec3(newScaleX, size.y, size.z);
+    }
+    void setScaleY(float newScaleY) {
+        size = vec3(size.x, newScaleY, size.z);
+    }
+    void setScaleZ(float newScaleZ) {
+        size = vec3(size.x, size.y, newScaleZ);
+    }
+    void setThetaX(float newTheta) {
+        theta.x = newTheta;
+    }
+    void setThetaY(float newTheta) {
+        theta.y = newTheta;
+    }
+    void setThetaZ(float newTheta) {
+        theta.z = newTheta;
+    }
+    void addThetaX(float thetaIncrement) {
+        theta.x += thetaIncrement;
+    }
+    void addThetaY(float thetaIncrement) {
+        theta.y += thetaIncrement;
+    }
+    void addThetaZ(float thetaIncrement) {
+        theta.z += thetaIncrement;
+    }
+    vec3 getPos() const {
+        return pos;
+    }
+    vec3 getScale() const {
+        return size;
+    }
+    vec3 getTheta() const {
+        return theta;
+    }
+
+    // Called at the start of every sim tick by entities that move, static entities always render as is
+    void saveState() {
+        prevPos = pos;
+        prevSize = size;
+        prevTheta = theta;
+        hasPrevState = true;
+    }
+    // Transform between the last two sim ticks, interpolation 0 is the previous tick and 1 the current one
+    vec3 getRenderPos(float interpolation) const {
+        return hasPrevState ? mix(prevPos, pos, interpolation) : pos;
+    }
+    vec3 getRenderScale(float interpolation) const {
+        return hasPrevState ? mix(prevSize, size, interpolation) : size;
+    }
+    vec3 getRenderTheta(float interpolation) const {
+        return hasPrevState ? mix(prevTheta, theta, interpolation) : theta;
+    }
+};
+
+class Camera : public Entity3D { 
+protected:
+    float windowWidth, windowHeight;
+    vec3 worldUp;
+    mat4 cameraPosMatrix;
+    vec3 cameraGaze;
+    mat4 cameraOrientation, viewMatrix, projectionMatrix;
+
+public:
+    Camera() {
+        //Empty Constructor
+    }
+    Camera(float newWindowWidth, float newWindowHeight) {
+        windowWidth = newWindowWidth;
+        windowHeight = newWindowHeight;
+
+        worldUp = normalize(vec3(0.f, 1.f, 0.f)); //Pointing upward
+
+        pos = vec3(0.0f, 0.0f, 1.0f);
+
+        cameraGaze = vec3(0.0f, 0.0f, 0.0f); // Gaze is where the camera is looking. In this case 0,0,0 is the center of the Model we are looking at
+
+        viewMatrix = lookAt(pos, cameraGaze, worldUp);
 
         projectionMatrix = mat4(1.0f);
     }
@@ -522,10 +2423,10 @@ public:
 
         viewMatrix = lookAt(pos, cameraGaze, worldUp);
     }
-    mat4 getViewMatrix() {
+    const mat4& getViewMatrix() const {
         return viewMatrix;
     }
-    mat4 getProjectionMatrix() {
+    const mat4& getProjectionMatrix() const {
         return projectionMatrix;
     }
 };
@@ -549,7 +2450,6 @@ public:
         specStr = 0.5f;
         specPhong = 15;
     }
-    virtual void getUserInput(GLFWwindow* window) {}
     
     void setRGB(vec3 newRGB) {
         lightColor = normalize(vec3(newRGB));
@@ -570,22 +2470,22 @@ public:
     void setLumens(float newLumens) {
         lightLumens = newLumens;
     }
-    vec3 getLightColor() {
+    vec3 getLightColor() const {
         return normalize(lightColor);
     }
-    float getLumens() {
+    float getLumens() const {
         return lightLumens;
     }
-    float getAmbientStr() {
+    float getAmbientStr() const {
         return ambientStr;
     }
-    vec3 getAmbientColor() {
+    vec3 getAmbientColor() const {
         return ambientColor;
     }
-    float getSpecStr() {
+    float getSpecStr() const {
         return specStr;
     }
-    float getSpecPhong() {
+    float getSpecPhong() const {
         return specPhong;
     }
 
@@ -614,18 +2514,108 @@ public:
     DirectionLight(vec3 newDirection) {
         direction = newDirection;
     }
-    vec3 getDirection() {
+    vec3 getDirection() const {
         return direction;
     }
 };
 
-class Model3D : public Entity3D {
-protected:
-    VAO* modelVAO;
-    Texture* texture;
-    Shader* modelShader;
+/* Everything a drawable needs to know about the current frame
+*  Built once per frame and handed to every draw by const reference, so no camera or light gets copied per model
+*/
+struct FrameContext {
+    mat4 view;
+    mat4 projection;
+    vec3 cameraPos;
+    const PointLight* pointLights[MAX_POINT_LIGHTS];
+    int pointLightCount;
+    const DirectionLight* directionLight;
+    double time;
+    // How far the frame is between the last two sim ticks, used to interpolate model transforms
+    float interpolation;
+
+    FrameContext(const Camera& camera, PointLight* const scenePointLights[], int scenePointLightCount, const DirectionLight& sceneDirectionLight, double frameTime, float simInterpolation = 1.0f) {
+        view = camera.getViewMatrix();
+        projection = camera.getProjectionMatrix();
+        cameraPos = camera.getPos();
+        pointLightCount = std::min(scenePointLightCount, MAX_POINT_LIGHTS);
+        for (int i = 0; i < pointLightCount; i++) {
+            pointLights[i] = scenePointLights[i];
+        }
+        directionLight = &sceneDirectionLight;
+        time = frameTime;
+        interpolation = simInterpolation;
+    }
+};
+
+// Owns the per frame uniform buffers, uploaded once per frame before anything is drawn
+class SceneUniforms {
+private:
+    UniformBuffer frameBuffer, lightBuffer;
+    FrameDataStd140 frameData;
+    LightDataStd140 lightData;
+
+public:
+    SceneUniforms() :frameBuffer(FRAME_DATA_BINDING, sizeof(FrameDataStd140)), lightBuffer(LIGHT_DATA_BINDING, sizeof(LightDataStd140)) {
+        memset(&frameData, 0, sizeof(frameData));
+        memset(&lightData, 0, sizeof(lightData));
+    }
+
+    void upload(const FrameContext& frame) {
+        frameData.view = frame.view;
+        frameData.projection = frame.projection;
+        frameData.cameraPos = vec4(frame.cameraPos, 1.0f);
+        frameBuffer.update(&frameData);
+
+        for (int i = 0; i < frame.pointLightCount; i++) {
+            const PointLight* pointLight = frame.pointLights[i];
+            PointLightStd140& light = lightData.pointLights[i];
+            light.position = vec4(pointLight->getPos(), 1.0f);
+            light.color = vec4(pointLight->getLightColor(), 1.0f);
+            light.ambientColor = vec4(pointLight->getAmbientColor(), 1.0f);
+            light.params = vec4(pointLight->getLumens(), pointLight->getAmbientStr(), pointLight->getSpecStr(), pointLight->getSpecPhong());
+        }
+        const DirectionLight* directionLight = frame.directionLight;
+        lightData.dirLightDirection = vec4(directionLight->getDirection(), 0.0f);
+        lightData.dirLightColor = vec4(directionLight->getLightColor(), 1.0f);
+        lightData.dirAmbientColor = vec4(directionLight->getAmbientColor(), 1.0f);
+        lightData.dirLightParams = vec4(directionLight->getLumens(), directionLight->getAmbientStr(), directionLight->getSpecStr(), directionLight->getSpecPhong());
+        lightBuffer.update(&lightData);
+    }
+};
+
+class Model3D : public Entity3D {
+protected:
+    VAO* modelVAO;
+    Texture* texture;
+    Shader* modelShader;
+    Shader* instancedShader = nullptr;
     mat4 identity_matrix, transformation_matrix;
+    mat3 normal_matrix;
     float transparency;
+    int pointLightIndex = 0;
+
+    void updateTransform(float interpolation) {
+        vec3 renderPos = getRenderPos(interpolation);
+        vec3 renderSize = getRenderScale(interpolation);
+        vec3 renderTheta = getRenderTheta(interpolation);
+
+        transformation_matrix = translate(identity_matrix, renderPos);
+        transformation_matrix = scale(transformation_matrix, renderSize);
+        transformation_matrix = rotate(transformation_matrix, radians(renderTheta.x), normalize(vec3(1.0f, 0.0f, 0.0f)));
+        transformation_matrix = rotate(transformation_matrix, radians(renderTheta.y), normalize(vec3(0.0f, 1.0f, 0.0f)));
+        transformation_matrix = rotate(transformation_matrix, radians(renderTheta.z), normalize(vec3(0.0f, 0.0f, 1.0f)));
+
+        /* Normal matrix, the inverse transpose of the upper 3x3, computed once per model instead of per vertex
+        *  With a uniform scale s the upper 3x3 is s * R, whose inverse transpose is R / s, so no inverse is needed
+        */
+        mat3 upper = mat3(transformation_matrix);
+        if (renderSize.x == renderSize.y && renderSize.y == renderSize.z && renderSize.x != 0.0f) {
+            normal_matrix = upper / (renderSize.x * renderSize.x);
+        }
+        else {
+            normal_matrix = transpose(inverse(upper));
+        }
+    }
 
 public:
     Model3D() {
@@ -639,144 +2629,80 @@ public:
         transparency = 1.0f;
     }
 
-    virtual void getUserInput(GLFWwindow* window) {};
-
     void setTransparency(float newTransparency) {
         transparency = newTransparency;
     }
+    bool isTransparent() const {
+        return transparency < 1.0f;
+    }
 
-    void draw(Camera camera, PointLight pointLight, DirectionLight directionLight) {
-
-        modelShader->activate(); //To update the uniformVariables, glUseProgram(shaderProg) first.
-
-        unsigned int viewLoc = glGetUniformLocation(modelShader->getShader(), "view");
-        glUniformMatrix4fv(viewLoc, 1, GL_FALSE, value_ptr(camera.getViewMatrix()));
-
-        unsigned int projLoc = glGetUniformLocation(modelShader->getShader(), "projection");
-        glUniformMatrix4fv(projLoc, 1, GL_FALSE, value_ptr(camera.getProjectionMatrix()));
-
-        unsigned int transformLocation = glGetUniformLocation(modelShader->getShader(), "transform");
-
-        transformation_matrix = translate(identity_matrix, pos);
-        transformation_matrix = scale(transformation_matrix, size);
-        transformation_matrix = rotate(transformation_matrix, radians(theta.x), normalize(vec3(1.0f, 0.0f, 0.0f)));
-        transformation_matrix = rotate(transformation_matrix, radians(theta.y), normalize(vec3(0.0f, 1.0f, 0.0f)));
-        transformation_matrix = rotate(transformation_matrix, radians(theta.z), normalize(vec3(0.0f, 0.0f, 1.0f)));
-
-        glUniformMatrix4fv(transformLocation, 1, GL_FALSE, value_ptr(transformation_matrix));
-
-        //Shader Update
-        switch (texture->getTexSlot()) {
-        case 0:
-            glActiveTexture(GL_TEXTURE0);
-            break;
-        case 1:
-            glActiveTexture(GL_TEXTURE1);
-            break;
-        case 2:
-            glActiveTexture(GL_TEXTURE2);
-            break;
-        case 3:
-            glActiveTexture(GL_TEXTURE3);
-            break;
-        case 4:
-            glActiveTexture(GL_TEXTURE4);
-            break;
-        case 5:
-            glActiveTexture(GL_TEXTURE5);
-            break;
-        case 6:
-            glActiveTexture(GL_TEXTURE6);
-            break;
-        }
-
-        switch (texture->getTexSlot()) {
-        case 0:
-            glActiveTexture(GL_TEXTURE0);
-            break;
-        case 1:
-            glActiveTexture(GL_TEXTURE1);
-            break;
-        case 2:
-            glActiveTexture(GL_TEXTURE2);
-            break;
-        case 3:
-            glActiveTexture(GL_TEXTURE3);
-            break;
-        case 4:
-            glActiveTexture(GL_TEXTURE4);
-            break;
-        case 5:
-            glActiveTexture(GL_TEXTURE5);
-            break;
-        case 6:
-            glActiveTexture(GL_TEXTURE6);
-            break;
-        }
-        glBindTexture(GL_TEXTURE_2D, texture->getTexture());
-        GLuint texAddress = glGetUniformLocation(modelShader->getShader(), "tex");
-        glUniform1i(texAddress, texture->getTexSlot());
-
-        GLfloat transparencyAddress = glGetUniformLocation(modelShader->getShader(), "transparency");
-        glUniform1f(transparencyAddress, transparency);
-
-        GLuint lightAddress = glGetUniformLocation(modelShader->getShader(), "lightPos");
-        glUniform3fv(lightAddress, 1, value_ptr(pointLight.getPos()));
-
-        GLuint lightColorAddress = glGetUniformLocation(modelShader->getShader(), "lightColor");
-        glUniform3fv(lightColorAddress, 1, value_ptr(pointLight.getLightColor()));
-
-        GLfloat lightLumensAddress = glGetUniformLocation(modelShader->getShader(), "lightLumens");
-        glUniform1f(lightLumensAddress, pointLight.getLumens());
-
-        GLuint ambientStrAddress = glGetUniformLocation(modelShader->getShader(), "ambientStr");
-        glUniform1f(ambientStrAddress, pointLight.getAmbientStr());
-
-        GLuint ambientColorAddress = glGetUniformLocation(modelShader->getShader(), "ambientColor");
-        glUniform3fv(ambientColorAddress, 1, value_ptr(pointLight.getAmbientColor()));
-
-        GLuint cameraPosAddress = glGetUniformLocation(modelShader->getShader(), "cameraPos");
-        glUniform3fv(cameraPosAddress, 1, value_ptr(camera.getPos()));
-
-        GLuint specStrAddress = glGetUniformLocation(modelShader->getShader(), "specStr");
-        glUniform1f(specStrAddress, pointLight.getSpecStr());
-
-        GLuint specPhongAddress = glGetUniformLocation(modelShader->getShader(), "specPhong");
-        glUniform1f(specPhongAddress, pointLight.getSpecPhong());
+    // Index into the FrameContext's point lights
+    void setPointLightIndex(int newPointLightIndex) {
+        pointLightIndex = newPointLightIndex;
+    }
+    int getPointLightIndex() const {
+        return pointLightIndex;
+    }
 
-        GLuint dirLightDirectionAddress = glGetUniformLocation(modelShader->getShader(), "dirLightDirection");
-        glUniform3fv(dirLightDirectionAddress, 1, value_ptr(directionLight.getDirection()));
+    // Shader used when the RenderQueue batches this model with others sharing its mesh and material
+    void setInstancedShader(Shader* newInstancedShader) {
+        instancedShader = newInstancedShader;
+    }
+    Shader* getInstancedShader() const {
+        return instancedShader;
+    }
 
-        GLuint dirLightColorAddress = glGetUniformLocation(modelShader->getShader(), "dirLightColor");
-        glUniform3fv(dirLightColorAddress, 1, value_ptr(directionLight.getLightColor()));
+    /* Draw state, used by the RenderQueue to sort draws and skip binds that are already current
+    *  The material ID is whatever identifies the bound textures, the color texture's GL name here
+    */
+    Shader* getShader() const {
+        return modelShader;
+    }
+    VAO* getModelVAO() const {
+        return modelVAO;
+    }
+    virtual GLuint getMaterialID() const {
+        return texture->getTexture();
+    }
 
-        GLfloat dirLightLumensAddress = glGetUniformLocation(modelShader->getShader(), "dirLightLumens");
-        glUniform1f(dirLightLumensAddress, directionLight.getLumens());
+    // Binds the textures and points the sampler at them, expects the shader to be active
+    virtual void bindMaterial(Shader* shader) {
+        glActiveTexture(GL_TEXTURE0 + texture->getTexSlot());
+        glBindTexture(GL_TEXTURE_2D, texture->getTexture());
+        shader->setInt(UniformID::tex, texture->getTexSlot());
+    }
 
-        GLuint dirAmbientStrAddress = glGetUniformLocation(modelShader->getShader(), "dirAmbientStr");
-        glUniform1f(dirAmbientStrAddress, directionLight.getAmbientStr());
+    // Per draw uniforms and the draw call itself, expects the shader, material and VAO to be bound
+    void drawGeometry(const FrameContext& frame) {
+        updateTransform(frame.interpolation);
+        modelShader->setMat4(UniformID::transform, transformation_matrix);
+        modelShader->setMat3(UniformID::normalMatrix, normal_matrix);
+        modelShader->setFloat(UniformID::transparency, transparency);
+        modelShader->setInt(UniformID::pointLightIndex, pointLightIndex);
 
-        GLuint dirAmbientColorAddress = glGetUniformLocation(modelShader->getShader(), "dirAmbientColor");
-        glUniform3fv(dirAmbientColorAddress, 1, value_ptr(directionLight.getAmbientColor()));
+        glDrawElements(GL_TRIANGLES, modelVAO->getDrawCount(), GL_UNSIGNED_INT, modelVAO->getDrawOffset());
+    }
 
-        GLuint dirSpecStrAddress = glGetUniformLocation(modelShader->getShader(), "dirSpecStr");
-        glUniform1f(dirSpecStrAddress, directionLight.getSpecStr());
+    // What drawGeometry would have set as uniforms, packed for the instance buffer
+    InstanceData getInstanceData(const FrameContext& frame) {
+        updateTransform(frame.interpolation);
+        InstanceData instance = { transformation_matrix, normal_matrix, transparency };
+        return instance;
+    }
 
-        GLuint dirSpecPhongAddress = glGetUniformLocation(modelShader->getShader(), "dirSpecPhong");
-        glUniform1f(dirSpecPhongAddress, pointLight.getSpecPhong());
+    // Immediate draw that binds everything itself, the RenderQueue is preferred for scene drawing
+    void draw(const FrameContext& frame) {
+        modelShader->activate(); //To update the uniformVariables, glUseProgram(shaderProg) first.
+        bindMaterial(modelShader);
 
         //Bind Current VAO
         glBindVertexArray(modelVAO->getVAO());
         //Draw Current VAO
-        glDrawArrays(GL_TRIANGLES, 0, modelVAO->getFullVertexData().size() / 8);
+        drawGeometry(frame);
         //Unbind VAO
         glBindVertexArray(0);
         //Set GL_Texture to 0 or default
         glActiveTexture(GL_TEXTURE0);
-
-        // Set glBlendFunc and Equation to "default"
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glBlendEquation(GL_FUNC_ADD);
     }
 };
 
@@ -788,147 +2714,796 @@ class NormalMapModel :public Model3D {
     public:
         NormalMapModel(VAO* newModelVao, NormalMapTexture* newNormTexture, Shader* newShader){
             modelVAO = newModelVao;
+            texture = newNormTexture;
             modelShader = newShader;
             identity_matrix = mat4(1.0f);
             transparency = 1.0f;
             normTexture = newNormTexture;
         }
 
-        void draw(Camera camera, PointLight pointLight, DirectionLight directionLight) {
+        GLuint getMaterialID() const override {
+            return normTexture->getNormTexture();
+        }
+
+        void bindMaterial(Shader* shader) override {
+            glActiveTexture(GL_TEXTURE0 + normTexture->getTexSlot());
+            glBindTexture(GL_TEXTURE_2D, normTexture->getTexture());
+
+            glActiveTexture(GL_TEXTURE0 + normTexture->getNormTexSlot());
+            glBindTexture(GL_TEXTURE_2D, normTexture->getNormTexture());
+            // Both slots used to be written to "tex" one after the other, the norm slot is the one that stuck
+            shader->setInt(UniformID::tex, normTexture->getNormTexSlot());
+        }
+        void update(float tickScale) {
+            theta.y += rotateSPD * tickScale;
+        }
+};
+
+/* GPU profiler
+*  Named, nestable scopes timed with glQueryCounter timestamps. Each frame writes into its own query pool and
+*  a pool is only read back FRAMES_IN_FLIGHT frames later, when the GPU is long done with it, so reading
+*  never stalls. A pool that still isn't ready is dropped instead of waited on.
+*  Per scope GPU times are kept over a rolling window of frames, and with capture on every scope is also kept
+*  as a trace event next to the CPU time it was issued at, for writeChromeTrace
+*/
+class GpuProfiler {
+public:
+    enum Track {
+        TRACK_RENDER_THREAD = 1,
+        TRACK_GPU = 2
+    };
 
-            modelShader->activate(); //To update the uniformVariables, glUseProgram(shaderProg) first.
+    struct TraceEvent {
+        uint32_t nameId;
+        uint32_t track;
+        double startUs, durationUs;
+    };
 
-            unsigned int viewLoc = glGetUniformLocation(modelShader->getShader(), "view");
-            glUniformMatrix4fv(viewLoc, 1, GL_FALSE, value_ptr(camera.getViewMatrix()));
+private:
+    static const size_t FRAMES_IN_FLIGHT = 3;
+    // Two timestamps per scope
+    static const size_t MAX_QUERIES = 128;
+    static const size_t MAX_TRACE_EVENTS = 500000;
+
+    struct Scope {
+        uint32_t nameId;
+        GLuint beginQuery, endQuery;
+        double cpuBeginUs, cpuEndUs;
+    };
 
-            unsigned int projLoc = glGetUniformLocation(modelShader->getShader(), "projection");
-            glUniformMatrix4fv(projLoc, 1, GL_FALSE, value_ptr(camera.getProjectionMatrix()));
+    struct QueryPool {
+        GLuint queries[MAX_QUERIES];
+        size_t used;
+        vector<Scope> scopes;
+        bool pending;
+    };
 
-            unsigned int transformLocation = glGetUniformLocation(modelShader->getShader(), "transform");
+    struct RollingTime {
+        vector<double> samples;
+        size_t next;
+        double sum;
+        double frameTotal;
+        bool seenThisFrame;
+    };
 
-            transformation_matrix = translate(identity_matrix, pos);
-            transformation_matrix = scale(transformation_matrix, size);
-            transformation_matrix = rotate(transformation_matrix, radians(theta.x), normalize(vec3(1.0f, 0.0f, 0.0f)));
-            transformation_matrix = rotate(transformation_matrix, radians(theta.y), normalize(vec3(0.0f, 1.0f, 0.0f)));
-            transformation_matrix = rotate(transformation_matrix, radians(theta.z), normalize(vec3(0.0f, 0.0f, 1.0f)));
+    bool supported;
+    QueryPool pools[FRAMES_IN_FLIGHT];
+    size_t frameNumber;
+    QueryPool* current;
+    // Index into current->scopes, or -1 for scopes dropped because the pool ran out of queries
+    vector<int> openScopes;
+
+    unordered_map<string, uint32_t> nameIds;
+    vector<string> names;
+    vector<RollingTime> times;
+    size_t windowFrames;
+    size_t collectedFrames, droppedFrames;
+
+    // GPU timestamps are nanoseconds on the GPU's own clock, this moves them onto traceNowUs
+    double gpuToTraceUs;
+
+    bool capture;
+    vector<TraceEvent> traceEvents;
+
+    uint32_t getNameId(const string& name) {
+        auto found = nameIds.find(name);
+        if (found != nameIds.end()) {
+            return found->second;
+        }
+        uint32_t id = (uint32_t)names.size();
+        nameIds[name] = id;
+        names.push_back(name);
+        RollingTime time;
+        time.samples.assign(windowFrames, 0.0);
+        time.next = 0;
+        time.sum = 0.0;
+        time.frameTotal = 0.0;
+        time.seenThisFrame = false;
+        times.push_back(time);
+        return id;
+    }
 
-            glUniformMatrix4fv(transformLocation, 1, GL_FALSE, value_ptr(transformation_matrix));
+    GLuint takeQuery() {
+        if (current->used >= MAX_QUERIES) {
+            return 0;
+        }
+        GLuint query = current->queries[current->used++];
+        glQueryCounter(query, GL_TIMESTAMP);
+        return query;
+    }
 
+    void collect(QueryPool& pool) {
+        pool.pending = false;
+        if (pool.used == 0) {
+            return;
+        }
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(pool.queries[pool.used - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (available != GL_TRUE) {
+            droppedFrames++;
+            return;
+        }
 
-            
-            GLuint texAddress = glGetUniformLocation(modelShader->getShader(), "tex");
-            switch(normTexture->getTexSlot()){
-            case 0:
-                glActiveTexture(GL_TEXTURE0);
-                break;
-            case 1:
-                glActiveTexture(GL_TEXTURE1);
-                break;
-            case 2:
-                glActiveTexture(GL_TEXTURE2);
-                break;
-            case 3:
-                glActiveTexture(GL_TEXTURE3);
-                break;
-            case 4:
-                glActiveTexture(GL_TEXTURE4);
-                break;
-            case 5:
-                glActiveTexture(GL_TEXTURE5);
-                break;
-            case 6:
-                glActiveTexture(GL_TEXTURE6);
-                break;
-            case 7:
-                glActiveTexture(GL_TEXTURE7);
-                break;
+        for (size_t i = 0; i < pool.scopes.size(); i++) {
+            const Scope& scope = pool.scopes[i];
+            GLuint64 gpuBegin = 0, gpuEnd = 0;
+            glGetQueryObjectui64v(scope.beginQuery, GL_QUERY_RESULT, &gpuBegin);
+            glGetQueryObjectui64v(scope.endQuery, GL_QUERY_RESULT, &gpuEnd);
+            double gpuMs = gpuEnd > gpuBegin ? (gpuEnd - gpuBegin) / 1000000.0 : 0.0;
+
+            // A name can be opened more than once a frame, its frame time is the sum
+            RollingTime& time = times[scope.nameId];
+            time.frameTotal += gpuMs;
+            time.seenThisFrame = true;
+
+            if (capture && traceEvents.size() + 2 <= MAX_TRACE_EVENTS) {
+                TraceEvent cpuEvent = { scope.nameId, TRACK_RENDER_THREAD, scope.cpuBeginUs, scope.cpuEndUs - scope.cpuBeginUs };
+                TraceEvent gpuEvent = { scope.nameId, TRACK_GPU, gpuBegin / 1000.0 + gpuToTraceUs, gpuMs * 1000.0 };
+                traceEvents.push_back(cpuEvent);
+                traceEvents.push_back(gpuEvent);
             }
-            glBindTexture(GL_TEXTURE_2D, normTexture->getTexture());
-            glUniform1i(texAddress, normTexture->getTexSlot());
+        }
 
-            
-            GLuint normAddress = glGetUniformLocation(modelShader->getShader(), "tex");
-            switch (normTexture->getNormTexSlot()) {
-            case 6:
-                glActiveTexture(GL_TEXTURE6);
-                break;
-            case 7:
-                glActiveTexture(GL_TEXTURE7);
-                break;
-            case 8:
-                glActiveTexture(GL_TEXTURE8);
-                break;
-            case 9:
-                glActiveTexture(GL_TEXTURE9);
-                break;
+        for (size_t i = 0; i < times.size(); i++) {
+            RollingTime& time = times[i];
+            if (!time.seenThisFrame) {
+                continue;
             }
-            glBindTexture(GL_TEXTURE_2D, normTexture->getNormTexture());
-            glUniform1i(normAddress, normTexture->getNormTexSlot());
+            time.sum += time.frameTotal - time.samples[time.next];
+            time.samples[time.next] = time.frameTotal;
+            time.next = (time.next + 1) % time.samples.size();
+            time.frameTotal = 0.0;
+            time.seenThisFrame = false;
+        }
+        collectedFrames++;
+    }
+
+public:
+    GpuProfiler(size_t newWindowFrames = 120) {
+        windowFrames = std::max(newWindowFrames, (size_t)1);
+        frameNumber = 0;
+        current = nullptr;
+        collectedFrames = 0;
+        droppedFrames = 0;
+        capture = false;
+        gpuToTraceUs = 0.0;
+
+        // Core since 3.3, older contexts need ARB_timer_query
+        supported = glQueryCounter != nullptr && glGetQueryObjectui64v != nullptr && glGetInteger64v != nullptr;
+        for (size_t i = 0; i < FRAMES_IN_FLIGHT; i++) {
+            pools[i].used = 0;
+            pools[i].pending = false;
+            if (supported) {
+                glGenQueries((GLsizei)MAX_QUERIES, pools[i].queries);
+            }
+        }
+        if (supported) {
+            GLint64 gpuNow = 0;
+            glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+            gpuToTraceUs = traceNowUs() - gpuNow / 1000.0;
+        }
+        else {
+            cout << "GPU: timer queries not available, GPU scopes are off" << endl;
+        }
+    }
+
+    ~GpuProfiler() {
+        if (supported) {
+            for (size_t i = 0; i < FRAMES_IN_FLIGHT; i++) {
+                glDeleteQueries((GLsizei)MAX_QUERIES, pools[i].queries);
+            }
+        }
+    }
+
+    // Keep every scope as a trace event from now on
+    void setCapture(bool newCapture) {
+        capture = newCapture;
+    }
+
+    // Reads back the pool this frame is about to reuse, then opens the frame's root scope
+    void beginFrame() {
+        if (!supported) {
+            return;
+        }
+        current = &pools[frameNumber % FRAMES_IN_FLIGHT];
+        if (current->pending) {
+            collect(*current);
+        }
+        current->used = 0;
+        current->scopes.clear();
+        openScopes.clear();
+        beginScope("Frame");
+    }
+
+    void endFrame() {
+        if (current == nullptr) {
+            return;
+        }
+        while (!openScopes.empty()) {
+            endScope();
+        }
+        current->pending = true;
+        current = nullptr;
+        frameNumber++;
+    }
+
+    void beginScope(const string& name) {
+        if (current == nullptr) {
+            return;
+        }
+        if (current->used + 2 > MAX_QUERIES) {
+            openScopes.push_back(-1);
+            return;
+        }
+        Scope scope;
+        scope.nameId = getNameId(name);
+        scope.cpuBeginUs = traceNowUs();
+        scope.beginQuery = takeQuery();
+        scope.endQuery = 0;
+        scope.cpuEndUs = scope.cpuBeginUs;
+        openScopes.push_back((int)current->scopes.size());
+        current->scopes.push_back(scope);
+    }
+
+    void endScope() {
+        if (current == nullptr || openScopes.empty()) {
+            return;
+        }
+        int scopeIndex = openScopes.back();
+        openScopes.pop_back();
+        if (scopeIndex < 0) {
+            return;
+        }
+        Scope& scope = current->scopes[scopeIndex];
+        scope.endQuery = takeQuery();
+        scope.cpuEndUs = traceNowUs();
+    }
+
+    // Average GPU time over the window, 0 for names that were never timed
+    double getAverageMs(const string& name) const {
+        auto found = nameIds.find(name);
+        if (found == nameIds.end()) {
+            return 0.0;
+        }
+        return times[found->second].sum / std::min(std::max(collectedFrames, (size_t)1), windowFrames);
+    }
+
+    const vector<string>& getNames() const {
+        return names;
+    }
+    const vector<TraceEvent>& getTraceEvents() const {
+        return traceEvents;
+    }
+
+    void printStats() const {
+        if (!supported) {
+            return;
+        }
+        cout << "GPU: Frames : " << collectedFrames << " : Dropped : " << droppedFrames
+            << " : Window : " << std::min(collectedFrames, windowFrames) << endl;
+        for (size_t i = 0; i < names.size(); i++) {
+            const vector<double>& samples = times[i].samples;
+            double maxMs = *max_element(samples.begin(), samples.end());
+            cout << "GPU: " << names[i] << " : Avg : " << getAverageMs(names[i]) << "ms : Max : " << maxMs << "ms" << endl;
+        }
+    }
+};
+
+/* Chrome trace
+*  Writes the profiler's scopes as complete ("X") events, the format chrome://tracing and Perfetto open.
+*  The render thread track shows when each scope was issued, the GPU track when it ran. Profiling builds add
+*  a track per thread with its CPU scopes. gpuProfiler can be null when there is no GL context
+*/
+bool writeChromeTrace(const string& filePath, const GpuProfiler* gpuProfiler) {
+    ofstream out(filePath, ios::trunc);
+    if (!out) {
+        return false;
+    }
+    out << fixed << setprecision(3);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << GpuProfiler::TRACK_RENDER_THREAD
+        << ", \"args\": {\"name\": \"Render Thread\"}},\n";
+    out << "  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << GpuProfiler::TRACK_GPU
+        << ", \"args\": {\"name\": \"GPU\"}}";
+
+    if (gpuProfiler != nullptr) {
+        const vector<string>& names = gpuProfiler->getNames();
+        const vector<GpuProfiler::TraceEvent>& events = gpuProfiler->getTraceEvents();
+        for (size_t i = 0; i < events.size(); i++) {
+            const GpuProfiler::TraceEvent& event = events[i];
+            out << ",\n  {\"name\": \"" << names[event.nameId] << "\", \"cat\": \""
+                << (event.track == GpuProfiler::TRACK_GPU ? "gpu" : "render") << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.track
+                << ", \"ts\": " << event.startUs << ", \"dur\": " << event.durationUs << "}";
+        }
+    }
+#ifdef KARTING_PROFILING
+    CpuTracer::writeTraceEvents(out);
+#endif
+    out << "\n]}\n";
+    return out.good();
+}
+
+/* Render queue
+*  Models submit a 64 bit sort key per frame, the queue sorts once and only rebinds the program,
+*  material or VAO when it differs from the previous draw
+*  Opaque:      pass(2) | 0 | shader(8) | material(12) | vao(10) | depth(24), front to back within the same state
+*  Transparent: pass(2) | 1 | inverted depth(24) | shader(8) | material(12) | vao(10), back to front
+*  Consecutive draws of the same mesh and material whose models have an instanced shader are merged
+*  into one glDrawElementsInstanced call, transparent runs keep their back to front order as instance order
+*/
+class RenderQueue {
+public:
+    enum Pass {
+        PASS_SKY = 0,
+        PASS_WORLD = 1,
+        PASS_OVERLAY = 2
+    };
+
+    struct Stats {
+        unsigned int draws;
+        unsigned int shaderBinds, materialBinds, vaoBinds;
+        unsigned int bindsAvoided;
+        unsigned int instancedDraws, instances;
+        unsigned int triangles;
+    };
+
+private:
+    struct RenderCommand {
+        uint64_t key;
+        Model3D* model;
+    };
+    vector<RenderCommand> commands;
+    vector<InstanceData> instanceScratch;
+    Stats stats;
+    float maxDepth;
+    GpuProfiler* profiler;
+
+    // Fewer models than this sharing a mesh are drawn one by one
+    static const size_t MIN_INSTANCE_RUN = 2;
+
+    // Whether two models can be drawn by the same instanced call
+    static bool canInstanceTogether(const Model3D* a, const Model3D* b) {
+        return a->getInstancedShader() != nullptr
+            && a->getInstancedShader() == b->getInstancedShader()
+            && a->getModelVAO() == b->getModelVAO()
+            && a->getMaterialID() == b->getMaterialID()
+            && a->isTransparent() == b->isTransparent()
+            && a->getPointLightIndex() == b->getPointLightIndex();
+    }
+
+    uint32_t quantizeDepth(float depth) const {
+        float normalizedDepth = glm::clamp(depth / maxDepth, 0.0f, 1.0f);
+        return (uint32_t)(normalizedDepth * 0xFFFFFF);
+    }
+
+public:
+    // maxDepth should match the camera's far plane
+    RenderQueue(float newMaxDepth) {
+        maxDepth = newMaxDepth;
+        profiler = nullptr;
+        memset(&stats, 0, sizeof(stats));
+    }
+
+    // With a profiler every pass gets a GPU scope, with one scope per shader inside it
+    void setProfiler(GpuProfiler* newProfiler) {
+        profiler = newProfiler;
+    }
+
+    void submit(Model3D* model, const FrameContext& frame, Pass pass = PASS_WORLD) {
+        uint64_t shaderID = model->getShader()->getShader() & 0xFF;
+        uint64_t materialID = model->getMaterialID() & 0xFFF;
+        uint64_t vaoID = model->getModelVAO()->getVAO() & 0x3FF;
+        // Distance to where the model is drawn this frame, so back to front matches what is on screen
+        uint64_t depth = quantizeDepth(length(model->getRenderPos(frame.interpolation) - frame.cameraPos));
+
+        uint64_t key = (uint64_t)pass << 62;
+        if (model->isTransparent()) {
+            key |= (uint64_t)1 << 61;
+            key |= (0xFFFFFF - depth) << 37;
+            key |= shaderID << 29 | materialID << 17 | vaoID << 7;
+        }
+        else {
+            key |= shaderID << 53 | materialID << 41 | vaoID << 31 | depth << 7;
+        }
+        RenderCommand command = { key, model };
+        commands.push_back(command);
+    }
+
+    void execute(const FrameContext& frame) {
+        TRACE_SCOPE("Render Queue");
+        memset(&stats, 0, sizeof(stats));
+        sort(commands.begin(), commands.end(), [](const RenderCommand& a, const RenderCommand& b) {
+            return a.key < b.key;
+        });
 
-            GLfloat transparencyAddress = glGetUniformLocation(modelShader->getShader(), "transparency");
-            glUniform1f(transparencyAddress, transparency);
+        // Blending is the same for every model, so it is set once instead of after every draw
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        glBlendEquation(GL_FUNC_ADD);
 
-            GLuint lightAddress = glGetUniformLocation(modelShader->getShader(), "lightPos");
-            glUniform3fv(lightAddress, 1, value_ptr(pointLight.getPos()));
+        Shader* currentShader = nullptr;
+        VAO* currentVAO = nullptr;
+        GLuint currentMaterial = 0;
+        bool materialBound = false;
+
+        // Pass and transparency bits of the key, indexes passScopeNames
+        static const char* passScopeNames[] = { "Sky", "Sky Transparent", "World Opaque", "World Transparent", "Overlay", "Overlay Transparent" };
+        int scopePass = -1;
+        Shader* scopeShader = nullptr;
+
+        size_t runEnd;
+        for (size_t i = 0; i < commands.size(); i = runEnd) {
+            Model3D* model = commands[i].model;
+
+            // Find how many of the following draws can share this one's instanced call
+            runEnd = i + 1;
+            if (model->getInstancedShader() != nullptr && model->getModelVAO()->isInstanced()) {
+                while (runEnd < commands.size() && canInstanceTogether(model, commands[runEnd].model)) {
+                    runEnd++;
+                }
+            }
+            bool instanced = runEnd - i >= MIN_INSTANCE_RUN;
+            if (!instanced) {
+                runEnd = i + 1;
+            }
 
-            GLuint lightColorAddress = glGetUniformLocation(modelShader->getShader(), "lightColor");
-            glUniform3fv(lightColorAddress, 1, value_ptr(pointLight.getLightColor()));
+            Shader* shader = instanced ? model->getInstancedShader() : model->getShader();
+            if (profiler != nullptr) {
+                int pass = (int)(commands[i].key >> 61);
+                if (pass != scopePass || shader != scopeShader) {
+                    if (scopeShader != nullptr) {
+                        profiler->endScope();
+                    }
+                    if (pass != scopePass) {
+                        if (scopePass >= 0) {
+                            profiler->endScope();
+                        }
+                        profiler->beginScope(passScopeNames[pass]);
+                        scopePass = pass;
+                    }
+                    profiler->beginScope(shader->getName());
+                    scopeShader = shader;
+                }
+            }
+            if (shader != currentShader) {
+                currentShader = shader;
+                currentShader->activate();
+                // Sampler uniforms belong to the program, so the material has to be set again
+                materialBound = false;
+                stats.shaderBinds++;
+            }
+            if (!materialBound || model->getMaterialID() != currentMaterial) {
+                currentMaterial = model->getMaterialID();
+                materialBound = true;
+                model->bindMaterial(currentShader);
+                stats.materialBinds++;
+            }
+            if (model->getModelVAO() != currentVAO) {
+                currentVAO = model->getModelVAO();
+                glBindVertexArray(currentVAO->getVAO());
+                stats.vaoBinds++;
+            }
 
-            GLfloat lightLumensAddress = glGetUniformLocation(modelShader->getShader(), "lightLumens");
-            glUniform1f(lightLumensAddress, pointLight.getLumens());
+            if (instanced) {
+                instanceScratch.clear();
+                for (size_t j = i; j < runEnd; j++) {
+                    instanceScratch.push_back(commands[j].model->getInstanceData(frame));
+                }
+                currentVAO->uploadInstances(instanceScratch.data(), instanceScratch.size());
+                currentShader->setInt(UniformID::pointLightIndex, model->getPointLightIndex());
+
+                glDrawElementsInstanced(GL_TRIANGLES, currentVAO->getDrawCount(), GL_UNSIGNED_INT,
+                    currentVAO->getDrawOffset(), (GLsizei)instanceScratch.size());
+                stats.instancedDraws++;
+                stats.instances += (unsigned int)instanceScratch.size();
+                stats.triangles += currentVAO->getDrawCount() / 3 * (unsigned int)instanceScratch.size();
+            }
+            else {
+                model->drawGeometry(frame);
+                stats.triangles += model->getModelVAO()->getDrawCount() / 3;
+            }
+            stats.draws++;
+        }
+        stats.bindsAvoided = stats.draws * 3 - (stats.shaderBinds + stats.materialBinds + stats.vaoBinds);
+        if (scopeShader != nullptr) {
+            profiler->endScope();
+            profiler->endScope();
+        }
 
-            GLuint ambientStrAddress = glGetUniformLocation(modelShader->getShader(), "ambientStr");
-            glUniform1f(ambientStrAddress, pointLight.getAmbientStr());
+        glBindVertexArray(0);
+        glActiveTexture(GL_TEXTURE0);
+        commands.clear();
+    }
 
-            GLuint ambientColorAddress = glGetUniformLocation(modelShader->getShader(), "ambientColor");
-            glUniform3fv(ambientColorAddress, 1, value_ptr(pointLight.getAmbientColor()));
+    const Stats& getStats() const {
+        return stats;
+    }
+    void printStats() const {
+        cout << "RENDER: Draws : " << stats.draws
+            << " : Shader Binds : " << stats.shaderBinds
+            << " : Material Binds : " << stats.materialBinds
+            << " : VAO Binds : " << stats.vaoBinds
+            << " : Binds Avoided : " << stats.bindsAvoided
+            << " : Instanced Draws : " << stats.instancedDraws
+            << " : Instances : " << stats.instances
+            << " : Triangles : " << stats.triangles << endl;
+    }
+};
 
-            GLuint cameraPosAddress = glGetUniformLocation(modelShader->getShader(), "cameraPos");
-            glUniform3fv(cameraPosAddress, 1, value_ptr(camera.getPos()));
+// 16 byte aligned float arrays, so the kart integrator can use aligned SSE loads
+float* allocateAlignedFloats(size_t count) {
+#ifdef _WIN32
+    return (float*)_aligned_malloc(count * sizeof(float), 16);
+#else
+    void* block = nullptr;
+    if (posix_memalign(&block, 16, count * sizeof(float)) != 0) {
+        return nullptr;
+    }
+    return (float*)block;
+#endif
+}
 
-            GLuint specStrAddress = glGetUniformLocation(modelShader->getShader(), "specStr");
-            glUniform1f(specStrAddress, pointLight.getSpecStr());
+void freeAlignedFloats(float* block) {
+#ifdef _WIN32
+    _aligned_free(block);
+#else
+    free(block);
+#endif
+}
 
-            GLuint specPhongAddress = glGetUniformLocation(modelShader->getShader(), "specPhong");
-            glUniform1f(specPhongAddress, pointLight.getSpecPhong());
+// Sim rate the per tick kart and animation constants were tuned at. Other rates multiply each tick's
+// change by SIM_REFERENCE_RATE / rate, so a race takes the same sim time at any rate
+const double SIM_REFERENCE_RATE = 60.0;
 
-            GLuint dirLightDirectionAddress = glGetUniformLocation(modelShader->getShader(), "dirLightDirection");
-            glUniform3fv(dirLightDirectionAddress, 1, value_ptr(directionLight.getDirection()));
+// Kart::update and both KartStore paths step karts with these, in float, so a kart moves the same either way
+const float KART_ROLL_DECAY_DIVISOR = 1.5f;
+const float KART_COAST_DECELERATION = 0.77f;
 
-            GLuint dirLightColorAddress = glGetUniformLocation(modelShader->getShader(), "dirLightColor");
-            glUniform3fv(dirLightColorAddress, 1, value_ptr(directionLight.getLightColor()));
+/* Kart store
+*  Kart movement state for many karts, one contiguous array per field instead of one object per kart.
+*  update() is Kart::update for every kart at once, four karts per SSE instruction
+*  Capacity is rounded up to a multiple of 4 and unused lanes stay zeroed, so the SIMD loop has no tail
+*/
+class KartStore {
+private:
+    size_t count, capacity;
+
+    float* posX;
+    float* posY;
+    float* posZ;
+    float* dirX;
+    float* dirY;
+    float* dirZ;
+    float* speed;
+    float* maxSpeed;
+    float* acceleration;
+    // Acceleration a held kart goes back to when released
+    float* baseAcceleration;
+    float* roll;
+    float* rollDecay;
+    // 1 while the kart is racing, 0 once it is stopped or has finished
+    float* active;
+
+    vector<double> finishTime;
+    vector<bool> finished;
+    size_t finishedCount;
+
+    // Every per kart array, so they can be allocated and freed together
+    vector<float**> fields() {
+        return { &posX, &posY, &posZ, &dirX, &dirY, &dirZ, &speed, &maxSpeed, &acceleration, &baseAcceleration, &roll, &rollDecay, &active };
+    }
 
-            GLfloat dirLightLumensAddress = glGetUniformLocation(modelShader->getShader(), "dirLightLumens");
-            glUniform1f(dirLightLumensAddress, directionLight.getLumens());
+    // Kart::update's exact steps, also used when SSE isn't available
+    void updateScalar(size_t first, size_t last, float tickScale) {
+        for (size_t i = first; i < last; i++) {
+            // Steering/Rolling
+            if (roll[i] > 0.0f) {
+                roll[i] -= rollDecay[i] * tickScale;
+            }
+            if (roll[i] < 0.0f) {
+                roll[i] += rollDecay[i] * tickScale;
+            }
+            roll[i] = glm::clamp(roll[i], -55.0f, 55.0f);
 
-            GLuint dirAmbientStrAddress = glGetUniformLocation(modelShader->getShader(), "dirAmbientStr");
-            glUniform1f(dirAmbientStrAddress, directionLight.getAmbientStr());
+            //Basic Acceleration Deceleration Movement
+            speed[i] = std::min(speed[i], maxSpeed[i]);
+            if (active[i] != 0.0f) {
+                speed[i] += acceleration[i] * tickScale;
+            }
+            float distance = speed[i] * tickScale;
+            posX[i] += dirX[i] * distance;
+            posY[i] += dirY[i] * distance;
+            posZ[i] += dirZ[i] * distance;
+
+            // Deceleration
+            if (active[i] == 0.0f) {
+                speed[i] -= acceleration[i] * KART_COAST_DECELERATION * tickScale;
+            }
+            if (speed[i] <= 0.0f) {
+                speed[i] = 0.0f;
+            }
+        }
+    }
 
-            GLuint dirAmbientColorAddress = glGetUniformLocation(modelShader->getShader(), "dirAmbientColor");
-            glUniform3fv(dirAmbientColorAddress, 1, value_ptr(directionLight.getAmbientColor()));
+public:
+    KartStore(size_t maxKarts) {
+        count = 0;
+        capacity = std::max((maxKarts + 3) & ~(size_t)3, (size_t)4);
+        for (float** field : fields()) {
+            *field = allocateAlignedFloats(capacity);
+            memset(*field, 0, capacity * sizeof(float));
+        }
+        finishTime.assign(capacity, 0.0);
+        finished.assign(capacity, false);
+        finishedCount = 0;
+    }
+    ~KartStore() {
+        for (float** field : fields()) {
+            freeAlignedFloats(*field);
+        }
+    }
+    KartStore(const KartStore&) = delete;
+    KartStore& operator=(const KartStore&) = delete;
+
+    // Returns the kart's slot, turningSpeed is Kart's turningSPD
+    size_t addKart(const vec3& startPos, const vec3& startDir, float newMaxSpeed, float newAcceleration, float turningSpeed) {
+        if (count == capacity) {
+            cout << "KARTSTORE: full at " << capacity << " karts" << endl;
+            return capacity;
+        }
+        size_t slot = count++;
+        posX[slot] = startPos.x;
+        posY[slot] = startPos.y;
+        posZ[slot] = startPos.z;
+        dirX[slot] = startDir.x;
+        dirY[slot] = startDir.y;
+        dirZ[slot] = startDir.z;
+        speed[slot] = 0.0f;
+        maxSpeed[slot] = newMaxSpeed;
+        acceleration[slot] = newAcceleration;
+        baseAcceleration[slot] = newAcceleration;
+        roll[slot] = 0.0f;
+        rollDecay[slot] = turningSpeed / KART_ROLL_DECAY_DIVISOR;
+        active[slot] = 0.0f;
+        return slot;
+    }
 
-            GLuint dirSpecStrAddress = glGetUniformLocation(modelShader->getShader(), "dirSpecStr");
-            glUniform1f(dirSpecStrAddress, directionLight.getSpecStr());
+    // tickScale is SIM_REFERENCE_RATE / sim rate, 1 at the rate the constants were tuned at
+    void update(float tickScale) {
+#ifdef KARTING_SSE
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 maxRoll = _mm_set1_ps(55.0f);
+        const __m128 minRoll = _mm_set1_ps(-55.0f);
+        const __m128 decelerationScale = _mm_set1_ps(KART_COAST_DECELERATION);
+        const __m128 scale = _mm_set1_ps(tickScale);
+
+        for (size_t i = 0; i < count; i += 4) {
+            // Steering/Rolling, the second test sees the result of the first like the scalar code
+            __m128 r = _mm_load_ps(roll + i);
+            __m128 decay = _mm_mul_ps(_mm_load_ps(rollDecay + i), scale);
+            r = _mm_sub_ps(r, _mm_and_ps(_mm_cmpgt_ps(r, zero), decay));
+            r = _mm_add_ps(r, _mm_and_ps(_mm_cmplt_ps(r, zero), decay));
+            r = _mm_min_ps(_mm_max_ps(r, minRoll), maxRoll);
+            _mm_store_ps(roll + i, r);
+
+            //Basic Acceleration Deceleration Movement
+            __m128 s = _mm_min_ps(_mm_load_ps(speed + i), _mm_load_ps(maxSpeed + i));
+            __m128 a = _mm_load_ps(acceleration + i);
+            __m128 activeMask = _mm_cmpneq_ps(_mm_load_ps(active + i), zero);
+            s = _mm_add_ps(s, _mm_and_ps(activeMask, _mm_mul_ps(a, scale)));
+
+            __m128 distance = _mm_mul_ps(s, scale);
+            _mm_store_ps(posX + i, _mm_add_ps(_mm_load_ps(posX + i), _mm_mul_ps(_mm_load_ps(dirX + i), distance)));
+            _mm_store_ps(posY + i, _mm_add_ps(_mm_load_ps(posY + i), _mm_mul_ps(_mm_load_ps(dirY + i), distance)));
+            _mm_store_ps(posZ + i, _mm_add_ps(_mm_load_ps(posZ + i), _mm_mul_ps(_mm_load_ps(dirZ + i), distance)));
+
+            // Deceleration
+            s = _mm_sub_ps(s, _mm_andnot_ps(activeMask, _mm_mul_ps(_mm_mul_ps(a, decelerationScale), scale)));
+            s = _mm_max_ps(s, zero);
+            _mm_store_ps(speed + i, s);
+        }
+#else
+        updateScalar(0, count, tickScale);
+#endif
+    }
 
-            GLuint dirSpecPhongAddress = glGetUniformLocation(modelShader->getShader(), "dirSpecPhong");
-            glUniform1f(dirSpecPhongAddress, pointLight.getSpecPhong());
+    // Stops the kart and records its finish time, for karts whose crossing was detected outside the store
+    void finishKart(size_t slot, double simTime) {
+        if (finished[slot]) {
+            return;
+        }
+        finished[slot] = true;
+        finishTime[slot] = simTime;
+        active[slot] = 0.0f;
+        finishedCount++;
+    }
 
-            //Bind Current VAO
-            glBindVertexArray(modelVAO->getVAO());
-            //Draw Current VAO
-            glDrawArrays(GL_TRIANGLES, 0, modelVAO->getFullVertexData().size() / 8);
-            //Unbind VAO
-            glBindVertexArray(0);
-            //Set GL_Texture to 0 or default
-            glActiveTexture(GL_TEXTURE0);
+    // Stops every kart from firstSlot on as soon as its front crosses lineZ, their slots are appended to newlyFinished
+    void finishKarts(size_t firstSlot, float lineZ, float kartLength, double simTime, vector<size_t>& newlyFinished) {
+        for (size_t i = firstSlot; i < count; i++) {
+            if (!finished[i] && posZ[i] + kartLength >= lineZ) {
+                finishKart(i, simTime);
+                newlyFinished.push_back(i);
+            }
+        }
+    }
 
-            // Set glBlendFunc and Equation to "default"
-            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-            glBlendEquation(GL_FUNC_ADD);
+    // Every kart from firstSlot on, used for the AI field where individual karts don't matter
+    void setActiveFrom(size_t firstSlot, bool isActive) {
+        for (size_t i = firstSlot; i < count; i++) {
+            if (!finished[i]) {
+                active[i] = isActive ? 1.0f : 0.0f;
+            }
         }
-        void update() {
-            theta.y += rotateSPD;
+    }
+    // Held karts stand still like the ghosts do while stopCars is set
+    void holdFrom(size_t firstSlot, bool hold) {
+        for (size_t i = firstSlot; i < count; i++) {
+            acceleration[i] = hold ? 0.0f : baseAcceleration[i];
+            if (hold) {
+                speed[i] = 0.0f;
+            }
         }
+    }
+
+    size_t getCount() const {
+        return count;
+    }
+    size_t getFinishedCount() const {
+        return finishedCount;
+    }
+    bool isFinished(size_t slot) const {
+        return finished[slot];
+    }
+    double getFinishTime(size_t slot) const {
+        return finishTime[slot];
+    }
+
+    vec3 getPos(size_t slot) const {
+        return vec3(posX[slot], posY[slot], posZ[slot]);
+    }
+    void setPos(size_t slot, const vec3& newPos) {
+        posX[slot] = newPos.x;
+        posY[slot] = newPos.y;
+        posZ[slot] = newPos.z;
+    }
+    float getRoll(size_t slot) const {
+        return roll[slot];
+    }
+    float getSpeed(size_t slot) const {
+        return speed[slot];
+    }
+    void setSpeed(size_t slot, float newSpeed) {
+        speed[slot] = newSpeed;
+    }
+    void setAcceleration(size_t slot, float newAcceleration) {
+        acceleration[slot] = newAcceleration;
+    }
+    bool getActive(size_t slot) const {
+        return active[slot] != 0.0f;
+    }
+    void setActive(size_t slot, bool isActive) {
+        active[slot] = isActive ? 1.0f : 0.0f;
+    }
 };
 
 class Kart : public Model3D {
@@ -939,9 +3514,15 @@ protected:
     float speed, maxSPD, acceleration;
     vec3 kartDir;
     double startTime, endTime;
+
+    // Set once the kart's movement lives in a KartStore, the kart then only mirrors its slot for drawing
+    KartStore* store = nullptr;
+    size_t storeSlot = 0;
 public:
     Kart() {
         //empty constructor
+        startTime = 0.0;
+        endTime = 0.0;
     }
     Kart(VAO* newModelVao, Texture* newTexture, Shader* newShader, string newName, float maximumSpeed, float newAcceleration) {
         modelVAO = newModelVao;
@@ -963,14 +3544,31 @@ public:
         startTime = 0.0;
         endTime = 0.0;
     };
-    virtual void update() {
+
+    // Moves the kart's movement state into the store, call after the kart has been placed
+    void attachToStore(KartStore* newStore) {
+        store = newStore;
+        storeSlot = store->addKart(pos, kartDir, maxSPD, acceleration, turningSPD);
+        store->setActive(storeSlot, activated);
+    }
+
+    // tickScale is SIM_REFERENCE_RATE / sim rate, every per tick change below is multiplied by it
+    virtual void update(float tickScale) {
+        // The store has already stepped every kart this tick
+        if (store != nullptr) {
+            pos = store->getPos(storeSlot);
+            roll = store->getRoll(storeSlot);
+            speed = store->getSpeed(storeSlot);
+            theta.z = roll;
+            return;
+        }
 
         // Steering/Rolling
         if (roll > 0.0f) {
-            roll -= turningSPD / 1.5;
+            roll -= turningSPD / KART_ROLL_DECAY_DIVISOR * tickScale;
         }
         if (roll < 0.0f) {
-            roll += turningSPD / 1.5;
+            roll += turningSPD / KART_ROLL_DECAY_DIVISOR * tickScale;
         }
         if (roll > 55.f) {
             roll = 55.f;
@@ -986,13 +3584,13 @@ public:
         }
 
         if (activated) {
-            speed += acceleration;
+            speed += acceleration * tickScale;
         }
-        pos += kartDir * speed;
+        pos += kartDir * (speed * tickScale);
 
         // Deceleration
         if (!activated) {
-            speed -= (acceleration * 0.77);
+            speed -= (acceleration * KART_COAST_DECELERATION * tickScale);
         }
         if (speed <= 0.0f) {
             speed = 0.0f;
@@ -1006,21 +3604,53 @@ public:
     }
     void setSpeed(float newSpeed) {
         speed = newSpeed;
+        if (store != nullptr) {
+            store->setSpeed(storeSlot, newSpeed);
+        }
     }
     void setAcceleration(float newAcceleration) {
         acceleration = newAcceleration;
+        if (store != nullptr) {
+            store->setAcceleration(storeSlot, newAcceleration);
+        }
     }
     void printTime() {
-        cout << "KART: "<<name<<" : Time :"<<endTime - startTime<<":"<<endl;
+        cout << "KART: "<<name<<" : Time :"<<endTime - startTime<<":"<<'\n';
+    }
+    const string& getName() const {
+        return name;
+    }
+    double getTime() const {
+        return endTime - startTime;
     }
     void toggleActivation() {
         activated = !activated;
+        if (store != nullptr) {
+            store->setActive(storeSlot, activated);
+        }
     }
     bool getActivation() {
         return activated;
     }
 };
 
+// Player controls for one sim tick, read from the keyboard or generated when there is no window
+struct KartInput {
+    bool left = false;
+    bool right = false;
+    bool throttle = false;
+    bool brake = false;
+};
+
+KartInput pollKartInput(GLFWwindow* window) {
+    KartInput input;
+    input.left = glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS;
+    input.right = glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS;
+    input.throttle = glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS;
+    input.brake = glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS;
+    return input;
+}
+
 class PlayerKart : public Kart {
 private:
     float turningSPD, roll;
@@ -1054,10 +3684,10 @@ public:
         turningSPD = 0.05;
         roll = 0.0f;
     };
-    void getUserInput(GLFWwindow* window) {
-        if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
-            theta.y += turningSPD;
-            roll -= turningSPD / 1.15;
+    void applyInput(const KartInput& input, float tickScale) {
+        if (input.left) {
+            theta.y += turningSPD * tickScale;
+            roll -= turningSPD / 1.15 * tickScale;
             steeringDir = LEFT;
             kartDir = vec3(
                 1.0f * sin(radians(theta.y)), 
@@ -1065,9 +3695,9 @@ public:
                 1.0f * cos(radians(theta.y))
             );
         }
-        if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
-            theta.y -= turningSPD;
-            roll += turningSPD / 1.15;
+        if (input.right) {
+            theta.y -= turningSPD * tickScale;
+            roll += turningSPD / 1.15 * tickScale;
             steeringDir = RIGHT;
             kartDir = vec3(
                 1.0f * sin(radians(theta.y)),
@@ -1075,24 +3705,24 @@ public:
                 1.0f * cos(radians(theta.y))
             );
         }
-        if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
+        if (input.throttle) {
             acce = acceleration;
             accelerating = true;
         }
-        if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
+        if (input.brake) {
             acce = -acceleration;
             reverse = true;
         }
         
     };
-    void update() {
+    void update(float tickScale) override {
 
         // Steering/Rolling
         if (roll > 0.0f || steeringDir==LEFT) {
-            roll -= turningSPD * 2.5;
+            roll -= turningSPD * 2.5 * tickScale;
         }
         if (roll < 0.0f || steeringDir==RIGHT) {
-            roll += turningSPD * 2.5;
+            roll += turningSPD * 2.5 * tickScale;
         }
         if (roll > 55.f) {
             roll = 55.f;
@@ -1108,16 +3738,16 @@ public:
             speed = maxSPD;
         }
         
-        speed += acce;
+        speed += acce * tickScale;
         if (activated) {
-            pos += kartDir * speed;
+            pos += kartDir * (speed * tickScale);
         }
         acce = 0;
 
 
         // Deceleration
         if (!accelerating) {
-            speed -= acceleration*0.8;
+            speed -= acceleration*0.8 * tickScale;
         }
         if (speed <= 0.0f&&!reverse) {
             speed = 0.0f;
@@ -1132,6 +3762,9 @@ public:
     vec3 getDir() {
         return kartDir;
     }
+    float getSpeed() const {
+        return speed;
+    }
 };
 
 class PerspectiveCamera : public Camera {
@@ -1149,464 +3782,2434 @@ public:
         windowWidth = newWindowWidth;
         windowHeight = newWindowHeight;
 
-        distanceFromFocus = 2.0f;
+        distanceFromFocus = 2.0f;
+
+        sensitivity = 0.05;
+
+        POV_Cooldown = 0.5;
+        prevTime = glfwGetTime();
+        POV_3 = true;
+        scrollX = 0.0f;
+        scrollY = 0.0f;
+        mouseX = 0.0f;
+        mouseY = 0.0f;
+        prevMouseX = 0.0f;
+        prevMouseY = 0.0f;
+        thetaX = 180.0f; // To have the camera face the back of the kart instead
+        thetaY = 0.0f;
+        
+        worldUp = normalize(vec3(0.f, 1.f, 0.f)); //Pointing upward
+
+        pos = vec3(0.0f, 0.0f, 1.0f);
+        cameraGaze = vec3(0.0f, 0.0f, 0.0f); // Gaze is where the camera is looking. In this case 0,0,0 is the center of the Model we are looking at
+
+        viewMatrix = lookAt(pos, cameraGaze, worldUp);
+
+        projectionMatrix = perspective(
+            radians(60.f - pos.z),      //This is your FOV
+            windowHeight / windowWidth, //Aspect ratio
+            0.1f,                       //z-Near, should never be <= 0
+            100.f                       //z-Far   
+        );
+    }
+    void attachParent(PlayerKart* newParent) {
+        parent = newParent;
+    }
+    void getInputs(GLFWwindow* window) {
+        float zoomSpeed = 1.0f;
+        //Mouse Inputs
+        glfwGetCursorPos(window, &mouseX, &mouseY);
+
+        if (mouseX != prevMouseX) {
+            thetaX += (sensitivity * (prevMouseX - mouseX));
+            prevMouseX = mouseX;
+        }
+        if (mouseY != prevMouseY) {
+            thetaY += (sensitivity * (prevMouseY - mouseY));
+            prevMouseY = mouseY;
+            if (thetaY >= 89.0f) {
+                thetaY = 89.0f;
+            }
+            if (thetaY <= -89.0f) {
+                thetaY = -89.0f;
+            }
+        }
+
+        if (glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS)
+        {
+            if (glfwGetTime() - prevTime >= POV_Cooldown) {
+                POV_3 = !POV_3;
+                prevTime = glfwGetTime();
+            }
+        }
+        
+    }
+
+    // interpolation follows the kart's rendered position between sim ticks instead of its last tick
+    void update(float newWindowWidth, float newWindowHeight, float interpolation = 1.0f) {
+        windowWidth = newWindowWidth;
+        windowHeight = newWindowHeight;
+
+        vec3 parentPos = parent != nullptr ? parent->getRenderPos(interpolation) : vec3(0.0f);
+        if (POV_3 == true) {
+            //Update the tracking position of the camera to the position of its parent, the kart
+            if (parent != nullptr) {
+                cameraGaze.x = parentPos.x;
+                cameraGaze.y = parentPos.y;
+                cameraGaze.z = parentPos.z;
+            }
+            //  3rd person camera movement (Thin Matrix, 2024)
+            float groundDist = distanceFromFocus * cos(radians(thetaY));
+            pos = vec3(
+                cameraGaze.x + (groundDist * sin(radians(thetaX))),
+                cameraGaze.y + (-distanceFromFocus * sin(radians(thetaY))),
+                cameraGaze.z + (groundDist * cos(radians(thetaX)))
+            );
+        }
+        else{
+            if (parent != nullptr) {
+                pos = vec3(parentPos.x, parentPos.y + 0.15f, parentPos.z);
+                cameraGaze = vec3(pos + parent->getDir());
+            }
+        }
+
+
+        projectionMatrix = perspective(
+            radians(80.0f),      //This is your FOV
+            windowHeight / windowWidth, //Aspect ratio
+            0.1f,                       //z-Near, should never be <= 0
+            10000.f                       //z-Far   
+        );
+        viewMatrix = lookAt(pos, cameraGaze, worldUp);
+    }
+    void setZoom(float newZoom) {
+        distanceFromFocus = newZoom;
+    }
+    // Scripted stand in for the mouse, same angles in degrees getInputs turns it by
+    void setOrbit(float newThetaX, float newThetaY) {
+        thetaX = newThetaX;
+        thetaY = glm::clamp(newThetaY, -89.0f, 89.0f);
+    }
+};
+
+/* Skybox
+*  The cube and the skybox program, shared by every cubemap. Which cubemap it shows is picked per draw
+*/
+class Skybox {
+private:
+    Shader* skyboxShader;
+    unsigned int skyboxVAO, skyboxVBO, skyboxEBO;
+
+public:
+    Skybox(Shader* newSkyboxShader) {
+        skyboxShader = newSkyboxShader;
+
+        float skyboxVertices[]{
+            -1.f, -1.f, 1.f, //0
+            1.f, -1.f, 1.f,  //1
+            1.f, -1.f, -1.f, //2
+            -1.f, -1.f, -1.f,//3
+            -1.f, 1.f, 1.f,  //4
+            1.f, 1.f, 1.f,   //5
+            1.f, 1.f, -1.f,  //6
+            -1.f, 1.f, -1.f  //7
+        };
+
+        //Skybox Indices
+        unsigned int skyboxIndices[]{
+            1,2,6,
+            6,5,1,
+
+            0,4,7,
+            7,3,0,
+
+            4,5,6,
+            6,7,4,
+
+            0,3,2,
+            2,1,0,
+
+            0,1,5,
+            5,4,0,
+
+            3,7,6,
+            6,2,3
+        };
+
+        glGenVertexArrays(1, &skyboxVAO);
+        glGenBuffers(1, &skyboxVBO);
+
+        glBindVertexArray(skyboxVAO);
+        glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
+
+        glGenBuffers(1, &skyboxEBO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, skyboxEBO);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLint) * 36, &skyboxIndices, GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindVertexArray(0);
+    }
+    ~Skybox() {
+        glDeleteVertexArrays(1, &skyboxVAO);
+        glDeleteBuffers(1, &skyboxVBO);
+        glDeleteBuffers(1, &skyboxEBO);
+    }
+    // View and projection come from the FrameData block, the shader strips the view's position itself
+    void draw(GLuint cubemap) {
+        glDepthMask(GL_FALSE);
+        glDepthFunc(GL_LEQUAL);
+        skyboxShader->activate();
+
+        glBindVertexArray(skyboxVAO);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap);
+        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
+        glBindVertexArray(0);
+        glDepthMask(GL_TRUE);
+        glDepthFunc(GL_LESS);
+    }
+};
+
+/* Cubemap manager
+*  Skybox cubemaps are streamed on demand. The one in view is loaded first and the others can be prefetched
+*  behind it. Switching to a cubemap that is not in yet keeps showing the last one until it lands, so a switch
+*  never waits on a load. Cubemaps nobody has shown for a while are evicted, least recently used first, once
+*  the resident ones go over the byte budget
+*/
+class CubemapManager {
+private:
+    enum CubemapState {
+        CUBEMAP_UNLOADED,
+        CUBEMAP_LOADING,
+        CUBEMAP_RESIDENT
+    };
+
+    struct Cubemap {
+        string name;
+        vector<string> faces;
+        GLuint texture;
+        CubemapState state;
+        size_t bytes;
+        uint64_t lastUsedFrame;
+    };
+
+    TextureStreamer& streamer;
+    vector<Cubemap> cubemaps;
+    size_t budgetBytes;
+    uint64_t frame = 0;
+    // The last cubemap actually drawn, -1 before the first one is in
+    int shown = -1;
+    size_t evictions = 0;
+
+    int find(const string& name) const {
+        for (size_t i = 0; i < cubemaps.size(); i++) {
+            if (cubemaps[i].name == name) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+
+    void load(Cubemap& cubemap, bool urgent) {
+        glGenTextures(1, &cubemap.texture);
+        glBindTexture(GL_TEXTURE_CUBE_MAP, cubemap.texture);
+
+        // Alleviates the quality of the texture 200px -> 2000px
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        // Alleviates the quality of the texture 2000px -> 200px
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+        //UV == Tex
+        //ST == Face of the 3D Model
+        //RST== Cubemap
+
+        //Makes sure the texture is stretched to the edge
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        streamer.request(cubemap.texture, GL_TEXTURE_CUBE_MAP, cubemap.faces, false, false, urgent);
+        cubemap.state = CUBEMAP_LOADING;
+        cubemap.bytes = 0;
+    }
+
+    // Picks up uploads the streamer finished since the last frame
+    void refresh() {
+        for (size_t i = 0; i < cubemaps.size(); i++) {
+            Cubemap& cubemap = cubemaps[i];
+            if (cubemap.state == CUBEMAP_LOADING && !streamer.isPending(cubemap.texture)) {
+                cubemap.state = CUBEMAP_RESIDENT;
+                cubemap.bytes = streamer.getTextureBytes(cubemap.texture);
+            }
+        }
+    }
+
+    // Loading cubemaps and the ones in use are never evicted
+    void enforceBudget(int wanted) {
+        while (getResidentBytes() > budgetBytes) {
+            int oldest = -1;
+            for (size_t i = 0; i < cubemaps.size(); i++) {
+                if (cubemaps[i].state != CUBEMAP_RESIDENT || (int)i == shown || (int)i == wanted) {
+                    continue;
+                }
+                if (oldest < 0 || cubemaps[i].lastUsedFrame < cubemaps[oldest].lastUsedFrame) {
+                    oldest = (int)i;
+                }
+            }
+            if (oldest < 0) {
+                return;
+            }
+            Cubemap& cubemap = cubemaps[oldest];
+            glDeleteTextures(1, &cubemap.texture);
+            streamer.forget(cubemap.texture);
+            cubemap.texture = 0;
+            cubemap.state = CUBEMAP_UNLOADED;
+            cubemap.bytes = 0;
+            evictions++;
+        }
+    }
+public:
+    CubemapManager(TextureStreamer& newStreamer, size_t newBudgetBytes) : streamer(newStreamer) {
+        budgetBytes = newBudgetBytes;
+    }
+    ~CubemapManager() {
+        for (size_t i = 0; i < cubemaps.size(); i++) {
+            if (cubemaps[i].state != CUBEMAP_UNLOADED) {
+                glDeleteTextures(1, &cubemaps[i].texture);
+            }
+        }
+    }
+
+    // The directory holds right, left, top, bottom, front and back .png faces
+    void add(string name, string directory) {
+        Cubemap cubemap;
+        cubemap.name = name;
+        const char* faceNames[6] = { "right", "left", "top", "bottom", "front", "back" };
+        for (int i = 0; i < 6; i++) {
+            cubemap.faces.push_back(directory + faceNames[i] + ".png");
+        }
+        cubemap.texture = 0;
+        cubemap.state = CUBEMAP_UNLOADED;
+        cubemap.bytes = 0;
+        cubemap.lastUsedFrame = 0;
+        cubemaps.push_back(cubemap);
+    }
+
+    // Starts loading in the background, queued behind whatever is already loading
+    void prefetch(const string& name) {
+        int index = find(name);
+        if (index >= 0 && cubemaps[index].state == CUBEMAP_UNLOADED) {
+            load(cubemaps[index], false);
+        }
+    }
+
+    // Once per frame, the cubemap to draw for the one wanted. Until the wanted one is in, that is the last one shown,
+    // or the wanted one's placeholder if nothing has been shown yet
+    GLuint acquire(const string& name) {
+        frame++;
+        refresh();
+        int wanted = find(name);
+        if (wanted < 0) {
+            return shown >= 0 ? cubemaps[shown].texture : 0;
+        }
+        if (cubemaps[wanted].state == CUBEMAP_UNLOADED) {
+            load(cubemaps[wanted], true);
+        }
+        if (cubemaps[wanted].state == CUBEMAP_RESIDENT) {
+            shown = wanted;
+        }
+        enforceBudget(wanted);
+
+        int drawn = shown >= 0 ? shown : wanted;
+        cubemaps[drawn].lastUsedFrame = frame;
+        cubemaps[wanted].lastUsedFrame = frame;
+        return cubemaps[drawn].texture;
+    }
+
+    size_t getResidentBytes() const {
+        size_t bytes = 0;
+        for (size_t i = 0; i < cubemaps.size(); i++) {
+            bytes += cubemaps[i].bytes;
+        }
+        return bytes;
+    }
+    void printStats() const {
+        size_t resident = 0;
+        for (size_t i = 0; i < cubemaps.size(); i++) {
+            resident += cubemaps[i].state == CUBEMAP_RESIDENT ? 1 : 0;
+        }
+        cout << "CUBEMAPS: Resident : " << resident << "/" << cubemaps.size()
+            << " : Bytes : " << getResidentBytes() << " : Budget : " << budgetBytes
+            << " : Evictions : " << evictions << endl;
+    }
+};
+
+class TrafficLight:public Model3D{
+private:
+    bool startSequence, endSequence;
+    double sequenceTime, startTime;
+    float glow, rotateSPD;
+    bool greenLight;
+    double redTime, yellowTime, greenTime;
+    PointLight* childPointLight;
+    float half;
+    float r;
+    float g;
+    float b;
+public:
+    TrafficLight(VAO* newModelVao, Texture* newTexture, Shader* newShader, PointLight* newChildPointLight) {
+        modelVAO = newModelVao;
+        texture = newTexture;
+        modelShader = newShader;
+        childPointLight = newChildPointLight;
+        identity_matrix = mat4(1.0f);
+        transparency = 1.0f;
+
+        childPointLight->setRGB(vec3(10,10,10));
+        childPointLight->setLumens(4000.f);
+        redTime = 100.0;
+        yellowTime = 150.0;
+        greenTime = 250.0;
+        sequenceTime = 0.0f;
+        startTime = 0.0f;
+        startSequence = false;
+        endSequence = false;
+        greenLight = false;
+        glow = 0.0f;
+        rotateSPD = 0.15f;
+
+        half = 254/2;
+        r = 0;
+        g = 0;
+        b = 0;
+    }
+    void setRedTime(double newRedTime) {
+        redTime = newRedTime;
+    }
+    void setYellowTime(double newYellowTime) {
+        yellowTime = newYellowTime;
+    }
+    void setGreenTime(double newGreenTime) {
+        greenTime = newGreenTime;
+    }
+    void start(double currentTime) {
+        startSequence = true;
+        startTime = currentTime;
+    }
+    void end() {
+        endSequence = true;
+        rotateSPD=0.01;
+        childPointLight->setLumens(75000.0f *glow);
+        childPointLight->setRGB(vec3(r, g, b));
+    }
+    bool getGreenLight() {
+        return greenLight;
+    }
+    bool getStart() {
+        return startSequence;
+    }
+    void update(double currentTime, float tickScale) {
+        childPointLight->setPosX(pos.x);
+        childPointLight->setPosY(pos.y);
+        childPointLight->setPosZ(pos.z);
+
+        glow = 1.25+cos(currentTime*rotateSPD);
+
+        r = half + (half * sin(currentTime * 1.25));
+        g = half + (half * cos(currentTime * 1.35));
+        b = half + (half * sin(currentTime * 1.45));
+
+
+        if (!greenLight) {
+            size.x = (half + (b*0.25f)) * 0.35;
+            size.y = (half + (g*0.085f)) * 0.35;
+            size.z = (half + (r*0.25f)) * 0.35;
+        }
+
+        theta.x += rotateSPD *0.25f * tickScale;
+        theta.y += rotateSPD * tickScale;
+        theta.z += rotateSPD *0.005 * tickScale;
+
+        if (startSequence) {
+            sequenceTime = currentTime - startTime;
+            if (sequenceTime <= redTime) {
+                rotateSPD+=0.0001f * tickScale;
+                childPointLight->setLumens(40000.0f*glow);
+                childPointLight->setRGB(vec3(255, 0, 0));
+            }
+            else if (sequenceTime<=redTime + yellowTime) {
+                rotateSPD+=0.00075f * tickScale;
+                childPointLight->setLumens(65000.0f*glow);
+                childPointLight->setRGB(vec3(255, 200, 0));
+            }
+            else if (sequenceTime <=redTime + yellowTime + greenTime) {
+                rotateSPD=0;
+                setSize(pos.y * 0.3f);
+                theta = vec3(0, 0, 0);
+                childPointLight->setLumens(75000.0f*glow);
+                childPointLight->setRGB(vec3(0, 255, 0));
+                greenLight = true;
+            }
+            else {
+                end();
+            }
+
+        }
+    }
+};
+
+// One kart crossing the finish line, in the order they crossed
+struct FinishResult {
+    string name;
+    int rank;
+    double time;
+};
+
+class FinishLine : public Model3D {
+private:
+    int rank = 0;
+    // Batch races run quietly and only keep the results
+    bool verbose = true;
+    vector<FinishResult> results;
+public:
+    FinishLine(VAO* newModelVao, Texture* newTexture, Shader* newShader) {
+        modelVAO = newModelVao;
+        texture = newTexture;
+        modelShader = newShader;
+        identity_matrix = mat4(1.0f);
+        transparency = 1.0f;
+        rank = 0;
+    }
+
+    // Ranks the kart after everyone already recorded, the kart's end time must already be set
+    void recordFinish(Kart* kart) {
+        rank++;
+        FinishResult result = { kart->getName(), rank, kart->getTime() };
+        results.push_back(result);
+        if (verbose) {
+            cout << "RANK: " << rank << " ";
+            kart->printTime();
+        }
+    }
+
+    void setVerbose(bool newVerbose) {
+        verbose = newVerbose;
+    }
+    const vector<FinishResult>& getResults() const {
+        return results;
+    }
+};
+
+/* Race events
+*  Produced by the trigger system while it sweeps the karts, the race consumes them once per tick
+*/
+enum RaceEventType {
+    RACE_EVENT_CHECKPOINT,
+    RACE_EVENT_LAP,
+    RACE_EVENT_FINISH
+};
+
+struct RaceEvent {
+    RaceEventType type;
+    uint32_t racer;
+    // Checkpoint index, or the lap just completed for laps and finishes
+    int index;
+    double time;
+};
+
+// Karts are registered with their role, so handling an event never needs to ask what a kart is
+enum RacerRole {
+    RACER_PLAYER,
+    RACER_RIVAL
+};
+
+/* Trigger volumes
+*  A checkpoint or finish is a bounded rectangle on a plane. Each tick every racer's nose is swept from where
+*  it was last tick to where it is now, and the segment is tested against the next trigger the racer needs,
+*  so a kart fast enough to jump over a trigger in one tick still crosses it. Checkpoints have to be taken
+*  in order, and crossing the finish after all of them completes a lap
+*/
+class TriggerSystem {
+private:
+    struct TriggerVolume {
+        vec3 center, normal, right, up;
+        float halfWidth, halfHeight;
+    };
+
+    struct Racer {
+        Kart* kart;
+        RacerRole role;
+        vec3 lastNose;
+        uint32_t nextCheckpoint;
+        int lap;
+        bool finished;
+    };
+
+    vector<TriggerVolume> checkpoints;
+    TriggerVolume finish;
+    bool hasFinish = false;
+    int lapCount = 1;
+
+    vector<Racer> racers;
+    vector<RaceEvent> events;
+
+    // Karts drive along +z, their nose is the front of their scaled bounds
+    static vec3 getNose(const Kart* kart) {
+        return kart->getPos() + vec3(0.0f, 0.0f, kart->getScale().z);
+    }
+
+    static TriggerVolume makeVolume(vec3 center, vec3 normal, float halfWidth, float halfHeight) {
+        TriggerVolume volume;
+        volume.center = center;
+        volume.normal = normalize(normal);
+        // Upright triggers, the rectangle's width runs along the ground
+        volume.right = normalize(cross(vec3(0.0f, 1.0f, 0.0f), volume.normal));
+        volume.up = cross(volume.normal, volume.right);
+        volume.halfWidth = halfWidth;
+        volume.halfHeight = halfHeight;
+        return volume;
+    }
+
+    // Crossings only count from the back of the trigger to the front, fraction is how far along from->to it happened
+    static bool sweep(const TriggerVolume& volume, vec3 from, vec3 to, float& fraction) {
+        float fromDist = dot(from - volume.center, volume.normal);
+        float toDist = dot(to - volume.center, volume.normal);
+        if (fromDist >= 0.0f || toDist < 0.0f) {
+            return false;
+        }
+        fraction = fromDist / (fromDist - toDist);
+        vec3 hit = from + (to - from) * fraction - volume.center;
+        return abs(dot(hit, volume.right)) <= volume.halfWidth && abs(dot(hit, volume.up)) <= volume.halfHeight;
+    }
+
+    uint32_t addRacer(Kart* kart, RacerRole role) {
+        Racer racer = { kart, role, getNose(kart), 0, 0, false };
+        racers.push_back(racer);
+        return (uint32_t)(racers.size() - 1);
+    }
+public:
+    // Checkpoints are taken in the order they are added
+    void addCheckpoint(vec3 center, vec3 normal, float halfWidth, float halfHeight) {
+        checkpoints.push_back(makeVolume(center, normal, halfWidth, halfHeight));
+    }
+    void setFinish(vec3 center, vec3 normal, float halfWidth, float halfHeight) {
+        finish = makeVolume(center, normal, halfWidth, halfHeight);
+        hasFinish = true;
+    }
+    void setLapCount(int newLapCount) {
+        lapCount = std::max(newLapCount, 1);
+    }
+
+    // Register karts once they are placed on the grid, the returned id is the one events refer to
+    uint32_t addPlayer(PlayerKart* kart) {
+        return addRacer(kart, RACER_PLAYER);
+    }
+    uint32_t addRival(Kart* kart) {
+        return addRacer(kart, RACER_RIVAL);
+    }
+
+    // simTime is the end of the tick being swept
+    void update(double simTime) {
+        if (!hasFinish) {
+            return;
+        }
+        for (uint32_t id = 0; id < racers.size(); id++) {
+            Racer& racer = racers[id];
+            if (racer.finished) {
+                continue;
+            }
+            vec3 nose = getNose(racer.kart);
+            // A long tick can take a kart through several triggers, each one is swept from the last
+            vec3 from = racer.lastNose;
+            while (!racer.finished) {
+                bool atFinish = racer.nextCheckpoint == checkpoints.size();
+                const TriggerVolume& next = atFinish ? finish : checkpoints[racer.nextCheckpoint];
+                float fraction;
+                if (!sweep(next, from, nose, fraction)) {
+                    break;
+                }
+                from += (nose - from) * fraction;
+                RaceEvent event = { RACE_EVENT_CHECKPOINT, id, (int)racer.nextCheckpoint, simTime };
+                if (!atFinish) {
+                    racer.nextCheckpoint++;
+                }
+                else {
+                    racer.lap++;
+                    racer.nextCheckpoint = 0;
+                    event.index = racer.lap;
+                    event.type = RACE_EVENT_LAP;
+                    if (racer.lap >= lapCount) {
+                        event.type = RACE_EVENT_FINISH;
+                        racer.finished = true;
+                    }
+                }
+                events.push_back(event);
+            }
+            racer.lastNose = nose;
+        }
+    }
+
+    const vector<RaceEvent>& getEvents() const {
+        return events;
+    }
+    void clearEvents() {
+        events.clear();
+    }
+
+    Kart* getKart(uint32_t racer) const {
+        return racers[racer].kart;
+    }
+    RacerRole getRole(uint32_t racer) const {
+        return racers[racer].role;
+    }
+    int getLap(uint32_t racer) const {
+        return racers[racer].lap;
+    }
+    bool isFinished(uint32_t racer) const {
+        return racers[racer].finished;
+    }
+};
+
+/* Replay files
+*  One sample per sim tick of a kart's position, rotation and speed. Samples are quantized to integers
+*  and stored as zigzag varint deltas from the previous tick, with an absolute keyframe every
+*  keyframeInterval ticks so playback can jump anywhere without decoding from the start
+*  Layout: ReplayHeader | ReplayKeyframe[keyframeCount] | delta stream
+*/
+const int REPLAY_CHANNELS = 7; // pos xyz, theta xyz, speed
+
+struct ReplayHeader {
+    char magic[4];          // "KRPL"
+    uint32_t version;
+    double tickRate;
+    uint32_t tickCount;
+    uint32_t keyframeInterval;
+    uint32_t keyframeCount;
+    uint32_t streamSize;
+    float positionQuantum, angleQuantum, speedQuantum;
+    uint32_t padding;
+};
+
+// Absolute quantized sample at tick index * keyframeInterval, the deltas for the ticks after it start at streamOffset
+struct ReplayKeyframe {
+    uint32_t streamOffset;
+    int32_t state[REPLAY_CHANNELS];
+};
+
+class ReplayRecorder {
+private:
+    static const uint32_t VERSION = 1;
+    double tickRate;
+    uint32_t keyframeInterval;
+    uint32_t tickCount;
+    int32_t previousState[REPLAY_CHANNELS];
+    vector<ReplayKeyframe> keyframes;
+    vector<uint8_t> stream;
+
+    void writeVarint(int32_t delta) {
+        uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+        while (zigzag >= 0x80) {
+            stream.push_back((uint8_t)(zigzag | 0x80));
+            zigzag >>= 7;
+        }
+        stream.push_back((uint8_t)zigzag);
+    }
+
+public:
+    // About a millimetre, a 256th of a degree and a millionth of a unit per tick
+    static constexpr float POSITION_QUANTUM = 1.0f / 1024.0f;
+    static constexpr float ANGLE_QUANTUM = 1.0f / 256.0f;
+    static constexpr float SPEED_QUANTUM = 1.0f / 1048576.0f;
+
+    ReplayRecorder(double newTickRate, uint32_t newKeyframeInterval = 300) {
+        tickRate = newTickRate;
+        keyframeInterval = newKeyframeInterval;
+        tickCount = 0;
+        memset(previousState, 0, sizeof(previousState));
+    }
+
+    // Called once per sim tick, after the kart has updated
+    void record(const vec3& pos, const vec3& theta, float speed) {
+        int32_t state[REPLAY_CHANNELS] = {
+            (int32_t)lround(pos.x / POSITION_QUANTUM),
+            (int32_t)lround(pos.y / POSITION_QUANTUM),
+            (int32_t)lround(pos.z / POSITION_QUANTUM),
+            (int32_t)lround(theta.x / ANGLE_QUANTUM),
+            (int32_t)lround(theta.y / ANGLE_QUANTUM),
+            (int32_t)lround(theta.z / ANGLE_QUANTUM),
+            (int32_t)lround(speed / SPEED_QUANTUM)
+        };
+
+        if (tickCount % keyframeInterval == 0) {
+            ReplayKeyframe keyframe;
+            keyframe.streamOffset = (uint32_t)stream.size();
+            memcpy(keyframe.state, state, sizeof(state));
+            keyframes.push_back(keyframe);
+        }
+        else {
+            for (int c = 0; c < REPLAY_CHANNELS; c++) {
+                writeVarint(state[c] - previousState[c]);
+            }
+        }
+        memcpy(previousState, state, sizeof(state));
+        tickCount++;
+    }
+
+    bool save(string filePath) const {
+        ReplayHeader header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "KRPL", 4);
+        header.version = VERSION;
+        header.tickRate = tickRate;
+        header.tickCount = tickCount;
+        header.keyframeInterval = keyframeInterval;
+        header.keyframeCount = (uint32_t)keyframes.size();
+        header.streamSize = (uint32_t)stream.size();
+        header.positionQuantum = POSITION_QUANTUM;
+        header.angleQuantum = ANGLE_QUANTUM;
+        header.speedQuantum = SPEED_QUANTUM;
+
+        ofstream replayFile(filePath, ios::binary | ios::trunc);
+        if (!replayFile) {
+            return false;
+        }
+        replayFile.write((const char*)&header, sizeof(header));
+        replayFile.write((const char*)keyframes.data(), keyframes.size() * sizeof(ReplayKeyframe));
+        replayFile.write((const char*)stream.data(), stream.size());
+        return replayFile.good();
+    }
+
+    uint32_t getTickCount() const {
+        return tickCount;
+    }
+    size_t getByteSize() const {
+        return sizeof(ReplayHeader) + keyframes.size() * sizeof(ReplayKeyframe) + stream.size();
+    }
+    static uint32_t getVersion() {
+        return VERSION;
+    }
+};
+
+/* Replay ghost
+*  Plays a recording back as a kart. The file is memory-mapped and used in place, samples are decoded
+*  on demand from a cursor that only moves forward, so steady playback decodes each tick once
+*  Positions are interpolated between recorded ticks, so a replay plays back smoothly at any sim rate
+*/
+class ReplayKart : public Kart {
+private:
+    MappedFile* mappedFile;
+    const ReplayHeader* header;
+    const ReplayKeyframe* keyframes;
+    const uint8_t* stream;
+
+    // Decoder cursor, the quantized sample at cursorTick and where the next tick's deltas start
+    uint32_t cursorTick;
+    int32_t cursorState[REPLAY_CHANNELS];
+    size_t cursorOffset;
+
+    // The two samples being blended, kept until playback moves past them
+    bool sampleCached;
+    uint32_t sampleTick;
+    int32_t sampleState[REPLAY_CHANNELS], nextSampleState[REPLAY_CHANNELS];
+
+    static int32_t readVarint(const uint8_t* data, size_t size, size_t& offset) {
+        uint32_t zigzag = 0;
+        int shift = 0;
+        while (offset < size && shift < 35) {
+            uint8_t byte = data[offset++];
+            zigzag |= (uint32_t)(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0) {
+                break;
+            }
+            shift += 7;
+        }
+        return (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+    }
+
+    // Moves the cursor to tick, from the closest keyframe unless it can keep decoding forward
+    void seek(uint32_t tick) {
+        uint32_t keyframe = tick / header->keyframeInterval;
+        if (tick < cursorTick || keyframe != cursorTick / header->keyframeInterval) {
+            cursorTick = keyframe * header->keyframeInterval;
+            memcpy(cursorState, keyframes[keyframe].state, sizeof(cursorState));
+            cursorOffset = keyframes[keyframe].streamOffset;
+        }
+        while (cursorTick < tick) {
+            for (int c = 0; c < REPLAY_CHANNELS; c++) {
+                cursorState[c] += readVarint(stream, header->streamSize, cursorOffset);
+            }
+            cursorTick++;
+        }
+    }
+
+    void applyState(const int32_t state[], const int32_t nextState[], float blend) {
+        float sample[REPLAY_CHANNELS];
+        for (int c = 0; c < REPLAY_CHANNELS; c++) {
+            sample[c] = state[c] + (nextState[c] - state[c]) * blend;
+        }
+        pos = vec3(sample[0], sample[1], sample[2]) * header->positionQuantum;
+        theta = vec3(sample[3], sample[4], sample[5]) * header->angleQuantum;
+        speed = sample[6] * header->speedQuantum;
+    }
+
+public:
+    ReplayKart(VAO* newModelVao, Texture* newTexture, Shader* newShader, string replayPath, string newName) :
+        Kart(newModelVao, newTexture, newShader, newName, 0.0f, 0.0f) {
+        header = nullptr;
+        keyframes = nullptr;
+        stream = nullptr;
+        cursorTick = 0;
+        cursorOffset = 0;
+        sampleCached = false;
+        sampleTick = 0;
+
+        mappedFile = new MappedFile(replayPath);
+        if (!mappedFile->isOpen() || mappedFile->getSize() < sizeof(ReplayHeader)) {
+            cout << "REPLAY: could not open " << replayPath << endl;
+            return;
+        }
+        const ReplayHeader* fileHeader = (const ReplayHeader*)mappedFile->getData();
+        size_t expectedSize = sizeof(ReplayHeader) + (size_t)fileHeader->keyframeCount * sizeof(ReplayKeyframe) + fileHeader->streamSize;
+        if (memcmp(fileHeader->magic, "KRPL", 4) != 0 || fileHeader->version != ReplayRecorder::getVersion() ||
+            fileHeader->tickCount == 0 || fileHeader->keyframeInterval == 0 || mappedFile->getSize() < expectedSize ||
+            fileHeader->keyframeCount != (fileHeader->tickCount + fileHeader->keyframeInterval - 1) / fileHeader->keyframeInterval) {
+            cout << "REPLAY: " << replayPath << " is not a valid replay" << endl;
+            return;
+        }
+        header = fileHeader;
+        keyframes = (const ReplayKeyframe*)(header + 1);
+        stream = (const uint8_t*)(keyframes + header->keyframeCount);
+
+        // The cursor starts on the first keyframe, seek only ever decodes from a loaded keyframe
+        memcpy(cursorState, keyframes[0].state, sizeof(cursorState));
+        cursorOffset = keyframes[0].streamOffset;
+        applyState(cursorState, cursorState, 0.0f);
+    }
+
+    ~ReplayKart() {
+        delete mappedFile;
+    }
+
+    bool isValid() const {
+        return header != nullptr;
+    }
+
+    // Recorded sample i is the state at the end of tick i, at time (i + 1) / tickRate
+    void replayTo(double simTime) {
+        if (!isValid()) {
+            return;
+        }
+        double samplePosition = glm::clamp(simTime * header->tickRate - 1.0, 0.0, (double)(header->tickCount - 1));
+        uint32_t tick = (uint32_t)samplePosition;
+        float blend = (float)(samplePosition - tick);
+
+        if (!sampleCached || tick != sampleTick) {
+            seek(tick);
+            memcpy(sampleState, cursorState, sizeof(sampleState));
+            if (tick + 1 < header->tickCount) {
+                seek(tick + 1);
+            }
+            memcpy(nextSampleState, cursorState, sizeof(nextSampleState));
+            sampleTick = tick;
+            sampleCached = true;
+        }
+        applyState(sampleState, nextSampleState, blend);
+    }
+
+    // Past the last recorded tick, the kart just sits where the recording ended
+    bool isExhausted(double simTime) const {
+        return !isValid() || simTime * header->tickRate >= header->tickCount;
+    }
+
+    // Movement comes from the recording
+    void update(float) override {}
+};
+
+/* Collision
+*  Broadphase is a spatial hash: proxies are bucketed into uniform grid cells by their bounds and only
+*  proxies sharing a cell are tested against each other. A proxy only leaves and re-enters buckets when
+*  its cell range changes, which for karts moving a few centimetres a tick is rarely
+*  A pair spanning several cells is only tested in the cell holding the minimum corner of their overlap,
+*  so no pair is reported twice. Narrowphase handles spheres (karts) and boxes (props)
+*/
+enum CollisionLayer : uint32_t {
+    COLLISION_PLAYER = 1 << 0,
+    COLLISION_GHOST = 1 << 1,
+    COLLISION_AI = 1 << 2,
+    COLLISION_PROP = 1 << 3
+};
+
+struct CollisionContact {
+    uint32_t proxyA, proxyB;
+    // Points from A towards B
+    vec3 normal;
+    float depth;
+};
+
+class CollisionWorld {
+public:
+    enum Shape {
+        SHAPE_SPHERE,
+        SHAPE_BOX
+    };
+
+    struct Stats {
+        size_t proxies, occupiedCells, cellMoves;
+        size_t pairsTested, boundsOverlaps, contacts;
+        double broadphaseMs, narrowphaseMs;
+        double averageBroadphaseMs;
+    };
+
+private:
+    struct Proxy {
+        // Position comes from the entity, or from a KartStore slot for karts that have no entity
+        Entity3D* entity;
+        const KartStore* store;
+        size_t storeSlot;
+
+        Shape shape;
+        float radius;
+        vec3 halfExtents;
+        uint32_t layer, mask;
+
+        vec3 center;
+        ivec3 cellMin, cellMax;
+        bool inGrid;
+        bool enabled;
+    };
+
+    float cellSize;
+    vector<Proxy> proxies;
+    unordered_map<uint64_t, vector<uint32_t>> cells;
+    vector<pair<uint32_t, uint32_t>> candidates;
+    vector<CollisionContact> contacts;
+    Stats stats;
+    double totalBroadphaseMs;
+    uint64_t updateCount;
+
+    static uint64_t cellKey(int x, int y, int z) {
+        return ((uint64_t)(x & 0x1FFFFF) << 42) | ((uint64_t)(y & 0x1FFFFF) << 21) | (uint64_t)(z & 0x1FFFFF);
+    }
+    ivec3 cellOf(const vec3& point) const {
+        return ivec3(floor(point / cellSize));
+    }
+    vec3 boundsMin(const Proxy& proxy) const {
+        return proxy.center - (proxy.shape == SHAPE_SPHERE ? vec3(proxy.radius) : proxy.halfExtents);
+    }
+    vec3 boundsMax(const Proxy& proxy) const {
+        return proxy.center + (proxy.shape == SHAPE_SPHERE ? vec3(proxy.radius) : proxy.halfExtents);
+    }
+
+    void insertIntoCells(uint32_t id) {
+        Proxy& proxy = proxies[id];
+        for (int x = proxy.cellMin.x; x <= proxy.cellMax.x; x++) {
+            for (int y = proxy.cellMin.y; y <= proxy.cellMax.y; y++) {
+                for (int z = proxy.cellMin.z; z <= proxy.cellMax.z; z++) {
+                    cells[cellKey(x, y, z)].push_back(id);
+                }
+            }
+        }
+        proxy.inGrid = true;
+    }
+    void removeFromCells(uint32_t id) {
+        Proxy& proxy = proxies[id];
+        for (int x = proxy.cellMin.x; x <= proxy.cellMax.x; x++) {
+            for (int y = proxy.cellMin.y; y <= proxy.cellMax.y; y++) {
+                for (int z = proxy.cellMin.z; z <= proxy.cellMax.z; z++) {
+                    unordered_map<uint64_t, vector<uint32_t>>::iterator cell = cells.find(cellKey(x, y, z));
+                    if (cell == cells.end()) {
+                        continue;
+                    }
+                    vector<uint32_t>& bucket = cell->second;
+                    for (size_t i = 0; i < bucket.size(); i++) {
+                        if (bucket[i] == id) {
+                            bucket[i] = bucket.back();
+                            bucket.pop_back();
+                            break;
+                        }
+                    }
+                    if (bucket.empty()) {
+                        cells.erase(cell);
+                    }
+                }
+            }
+        }
+        proxy.inGrid = false;
+    }
+
+    uint32_t addProxy(const Proxy& proxy) {
+        proxies.push_back(proxy);
+        return (uint32_t)(proxies.size() - 1);
+    }
+
+    bool narrowphase(const Proxy& a, const Proxy& b, CollisionContact& contact) const {
+        if (a.shape == SHAPE_SPHERE && b.shape == SHAPE_SPHERE) {
+            vec3 offset = b.center - a.center;
+            float distance = length(offset);
+            if (distance >= a.radius + b.radius) {
+                return false;
+            }
+            contact.normal = distance > 0.0f ? offset / distance : vec3(0.0f, 1.0f, 0.0f);
+            contact.depth = a.radius + b.radius - distance;
+            return true;
+        }
+        if (a.shape == SHAPE_BOX && b.shape == SHAPE_BOX) {
+            vec3 overlap = (a.halfExtents + b.halfExtents) - abs(b.center - a.center);
+            if (overlap.x <= 0.0f || overlap.y <= 0.0f || overlap.z <= 0.0f) {
+                return false;
+            }
+            // Separate along the axis of least penetration
+            int axis = (overlap.x < overlap.y) ? (overlap.x < overlap.z ? 0 : 2) : (overlap.y < overlap.z ? 1 : 2);
+            contact.normal = vec3(0.0f);
+            contact.normal[axis] = (b.center[axis] >= a.center[axis]) ? 1.0f : -1.0f;
+            contact.depth = overlap[axis];
+            return true;
+        }
+
+        // Sphere against box, tested from the sphere's side and flipped back if the sphere is B
+        const Proxy& sphere = (a.shape == SHAPE_SPHERE) ? a : b;
+        const Proxy& box = (a.shape == SHAPE_SPHERE) ? b : a;
+        vec3 closest = glm::clamp(sphere.center, box.center - box.halfExtents, box.center + box.halfExtents);
+        vec3 offset = closest - sphere.center;
+        float distance = length(offset);
+        if (distance >= sphere.radius) {
+            return false;
+        }
+        vec3 sphereToBox = distance > 0.0f ? offset / distance : normalize(box.center - sphere.center + vec3(0.0f, 1e-6f, 0.0f));
+        contact.normal = (&sphere == &a) ? sphereToBox : -sphereToBox;
+        contact.depth = sphere.radius - distance;
+        return true;
+    }
+
+public:
+    // cellSize should be a few times the size of a kart, too small and proxies span many cells
+    CollisionWorld(float newCellSize = 4.0f) {
+        cellSize = newCellSize;
+        memset(&stats, 0, sizeof(stats));
+        totalBroadphaseMs = 0.0;
+        updateCount = 0;
+    }
+
+    // layer is what the proxy is, mask the layers it collides with. Both sides of a pair must accept the other
+    uint32_t addEntitySphere(Entity3D* entity, float radius, uint32_t layer, uint32_t mask) {
+        Proxy proxy = { entity, nullptr, 0, SHAPE_SPHERE, radius, vec3(radius), layer, mask, entity->getPos(), ivec3(0), ivec3(-1), false, true };
+        return addProxy(proxy);
+    }
+    uint32_t addEntityBox(Entity3D* entity, const vec3& halfExtents, uint32_t layer, uint32_t mask) {
+        Proxy proxy = { entity, nullptr, 0, SHAPE_BOX, 0.0f, halfExtents, layer, mask, entity->getPos(), ivec3(0), ivec3(-1), false, true };
+        return addProxy(proxy);
+    }
+    uint32_t addStoreSphere(const KartStore* store, size_t slot, float radius, uint32_t layer, uint32_t mask) {
+        Proxy proxy = { nullptr, store, slot, SHAPE_SPHERE, radius, vec3(radius), layer, mask, store->getPos(slot), ivec3(0), ivec3(-1), false, true };
+        return addProxy(proxy);
+    }
+
+    // Refreshes every proxy's position and rebuckets the ones that changed cells, then finds the contacts
+    void update() {
+        TRACE_SCOPE("Collisions");
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        stats.cellMoves = 0;
+        stats.pairsTested = 0;
+        stats.boundsOverlaps = 0;
+
+        for (uint32_t id = 0; id < proxies.size(); id++) {
+            Proxy& proxy = proxies[id];
+            if (!proxy.enabled) {
+                continue;
+            }
+            proxy.center = proxy.entity != nullptr ? proxy.entity->getPos() : proxy.store->getPos(proxy.storeSlot);
+            ivec3 newMin = cellOf(boundsMin(proxy));
+            ivec3 newMax = cellOf(boundsMax(proxy));
+            if (proxy.inGrid && newMin == proxy.cellMin && newMax == proxy.cellMax) {
+                continue;
+            }
+            if (proxy.inGrid) {
+                removeFromCells(id);
+            }
+            proxy.cellMin = newMin;
+            proxy.cellMax = newMax;
+            insertIntoCells(id);
+            stats.cellMoves++;
+        }
+
+        // Pairs whose bounds overlap, each reported once
+        candidates.clear();
+        for (unordered_map<uint64_t, vector<uint32_t>>::const_iterator cell = cells.begin(); cell != cells.end(); cell++) {
+            const vector<uint32_t>& bucket = cell->second;
+            for (size_t i = 0; i < bucket.size(); i++) {
+                const Proxy& a = proxies[bucket[i]];
+                for (size_t j = i + 1; j < bucket.size(); j++) {
+                    const Proxy& b = proxies[bucket[j]];
+                    if ((a.mask & b.layer) == 0 || (b.mask & a.layer) == 0) {
+                        continue;
+                    }
+                    stats.pairsTested++;
+                    vec3 overlapMin = max(boundsMin(a), boundsMin(b));
+                    vec3 overlapMax = min(boundsMax(a), boundsMax(b));
+                    if (overlapMin.x > overlapMax.x || overlapMin.y > overlapMax.y || overlapMin.z > overlapMax.z) {
+                        continue;
+                    }
+                    ivec3 ownerCell = cellOf(overlapMin);
+                    if (cellKey(ownerCell.x, ownerCell.y, ownerCell.z) != cell->first) {
+                        continue;
+                    }
+                    candidates.push_back(make_pair(std::min(bucket[i], bucket[j]), std::max(bucket[i], bucket[j])));
+                }
+            }
+        }
+        stats.boundsOverlaps = candidates.size();
+        chrono::steady_clock::time_point broadphaseEnd = chrono::steady_clock::now();
+
+        // Sorted so contacts come out in the same order whatever order the hash map iterates in
+        sort(candidates.begin(), candidates.end());
+        contacts.clear();
+        for (size_t i = 0; i < candidates.size(); i++) {
+            CollisionContact contact;
+            contact.proxyA = candidates[i].first;
+            contact.proxyB = candidates[i].second;
+            if (narrowphase(proxies[contact.proxyA], proxies[contact.proxyB], contact)) {
+                contacts.push_back(contact);
+            }
+        }
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+
+        stats.proxies = proxies.size();
+        stats.occupiedCells = cells.size();
+        stats.contacts = contacts.size();
+        stats.broadphaseMs = chrono::duration<double, milli>(broadphaseEnd - start).count();
+        stats.narrowphaseMs = chrono::duration<double, milli>(end - broadphaseEnd).count();
+        totalBroadphaseMs += stats.broadphaseMs;
+        updateCount++;
+        stats.averageBroadphaseMs = totalBroadphaseMs / updateCount;
+    }
+
+    uint32_t getProxyCount() const {
+        return (uint32_t)proxies.size();
+    }
+
+    // Disabled proxies leave the grid and are skipped until enabled again
+    void setEnabled(uint32_t proxy, bool enabled) {
+        if (!enabled && proxies[proxy].inGrid) {
+            removeFromCells(proxy);
+        }
+        proxies[proxy].enabled = enabled;
+    }
+
+    const vector<CollisionContact>& getContacts() const {
+        return contacts;
+    }
+    // Null for proxies that track a KartStore slot
+    Entity3D* getEntity(uint32_t proxy) const {
+        return proxies[proxy].entity;
+    }
+    uint32_t getLayer(uint32_t proxy) const {
+        return proxies[proxy].layer;
+    }
+
+    const Stats& getStats() const {
+        return stats;
+    }
+    void printStats() const {
+        cout << "COLLISION: Proxies : " << stats.proxies
+            << " : Cells : " << stats.occupiedCells
+            << " : Cell Moves : " << stats.cellMoves
+            << " : Pairs Tested : " << stats.pairsTested
+            << " : Overlaps : " << stats.boundsOverlaps
+            << " : Contacts : " << stats.contacts
+            << " : Broadphase : " << stats.broadphaseMs << "ms (avg " << stats.averageBroadphaseMs << "ms)"
+            << " : Narrowphase : " << stats.narrowphaseMs << "ms" << endl;
+    }
+};
+
+/* GPU resources the race models draw with
+*  Every field can be null, the race logic itself never touches them, which is what lets
+*  the headless mode build the same race without a GL context
+*/
+struct RaceAssets {
+    VAO* planeVAO = nullptr;
+    VAO* spaceCarVAO = nullptr;
+    VAO* artifactVAO = nullptr;
+    Texture* planeTex = nullptr;
+    Texture* spaceCarTex = nullptr;
+    Texture* artifactTex = nullptr;
+    Shader* objectShader = nullptr;
+    Shader* solidColorShader = nullptr;
+};
+
+/* Race tuning
+*  The defaults are the shipped race, the batch runner jitters them per seed for balance tuning
+*  Ghost accelerations are the values applied every tick once the race is running
+*/
+struct RaceConfig {
+    uint64_t seed = 0;
+    float turtleMaxSpeed = 0.04f;
+    float turtleAcceleration = 0.00006f;
+    float hareMaxSpeed = 0.033f;
+    float hareAcceleration = 0.00004f;
+    double redTime = 2.5;
+    double yellowTime = 4.0;
+    double greenTime = 3.5;
+    size_t aiKarts = 0;
+    // Recording to race against as an extra ghost, none when empty
+    string replayPath;
+    // Prints RANK lines as karts finish
+    bool verbose = true;
+    // Ticks per second race.tick is called at, kart and animation steps are scaled to it
+    double simRate = SIM_REFERENCE_RATE;
+};
+
+/* Race
+*  The karts, traffic light and finish line, and the rules that tie them together. Time only
+*  comes in through tick, so the windowed game and the headless sim step the exact same logic
+*/
+class Race {
+private:
+    // Declared before the traffic light, which sets it up in its constructor
+    PointLight trafficPointLight;
+
+    // Movement state of the ghosts and the AI field, stepped in one batch per tick
+    KartStore kartStore;
+
+    FinishLine finishLine;
+    PlayerKart player;
+    Kart ghost1, ghost2;
+    TrafficLight trafficLight;
+
+    /* AI field, lined up on a grid behind the named karts
+    *  With a mesh to draw them, every AI kart gets a Kart view. Without one (headless) they only exist in the store
+    */
+    size_t aiKartCount, firstAISlot;
+    vector<unique_ptr<Kart>> aiKarts;
+    bool aiHeld;
+
+    // Replay ghost, its race is over once it crosses the line or its recording runs out
+    unique_ptr<ReplayKart> replayKart;
+    bool replayFinished;
+
+    // Karts against each other and against props, ghosts are on a layer nothing collides with
+    CollisionWorld collisionWorld;
+    float kartRadius;
+    // AI proxies are added in slot order, finished AI karts are taken out of the world
+    uint32_t firstAIProxy;
+    vector<size_t> finishedAISlots;
+
+    // Finish line crossings of every kart with a view, AI views are registered last starting at firstAIRacer
+    TriggerSystem triggers;
+    uint32_t playerRacer, ghost1Racer, ghost2Racer, replayRacer, firstAIRacer;
+
+    RaceConfig config;
+    bool raceStarted, stopCars;
+
+    void handleRaceEvents() {
+        const vector<RaceEvent>& events = triggers.getEvents();
+        for (size_t i = 0; i < events.size(); i++) {
+            const RaceEvent& event = events[i];
+            if (event.type != RACE_EVENT_FINISH) {
+                continue;
+            }
+            // AI views are driven by the store, so their finish is recorded there and summarized instead of ranked
+            if (event.racer >= firstAIRacer && event.racer - firstAIRacer < aiKarts.size()) {
+                size_t aiIndex = event.racer - firstAIRacer;
+                size_t slot = firstAISlot + aiIndex;
+                if (kartStore.getActive(slot)) {
+                    kartStore.finishKart(slot, event.time);
+                    collisionWorld.setEnabled(firstAIProxy + (uint32_t)aiIndex, false);
+                }
+                continue;
+            }
+            // Karts that cross before the green light finish without a time
+            Kart* kart = triggers.getKart(event.racer);
+            if (kart->getActivation()) {
+                // The player keeps driving past the line, everyone else pulls up
+                if (triggers.getRole(event.racer) == RACER_RIVAL) {
+                    kart->toggleActivation();
+                }
+                kart->setEndTime(event.time);
+                finishLine.recordFinish(kart);
+            }
+        }
+        triggers.clearEvents();
+    }
+
+public:
+    Race(const RaceAssets& assets, const RaceConfig& newConfig = RaceConfig()) :
+        kartStore(2 + newConfig.aiKarts),
+        finishLine(assets.planeVAO, assets.planeTex, assets.solidColorShader),
+        player(assets.spaceCarVAO, assets.spaceCarTex, assets.objectShader, "Player", 0.035f, 0.00005f),
+        ghost1(assets.spaceCarVAO, assets.spaceCarTex, assets.objectShader, "Turtle", newConfig.turtleMaxSpeed, newConfig.turtleAcceleration), // Faster
+        ghost2(assets.spaceCarVAO, assets.spaceCarTex, assets.objectShader, "Hare", newConfig.hareMaxSpeed, newConfig.hareAcceleration), // Slower
+        trafficLight(assets.artifactVAO, assets.artifactTex, assets.objectShader, &trafficPointLight) {
+
+        // Finish Line
+        finishLine.setPosY(1.85f);
+        finishLine.setPosZ(400.0f);
+        finishLine.setScaleX(40.0f);
+        finishLine.setScaleY(0.1f);
+
+        // Karts
+        player.setPosY(2.0f);
+        player.setPosZ(-3.0f);
+        player.setSize(0.25f);
+        ghost1.setTransparency(0.1f);
+        ghost1.setSize(0.25f);
+        ghost1.setPosY(2.0f);
+        ghost1.setPosZ(-2.8f);
+        ghost1.setPosX(2.25f);
+        ghost2.setTransparency(0.1f);
+        ghost2.setSize(0.25f);
+        ghost2.setPosY(2.0f);
+        ghost2.setPosZ(-2.0f);
+        ghost2.setPosX(-2.25f);
+
+        trafficLight.setTransparency(1.0f);
+        trafficLight.setSize(30.f);
+        trafficLight.setPosY(200.0f);
+        trafficLight.setPosZ(400.0f);
+        config = newConfig;
+        trafficLight.setRedTime(config.redTime);
+        trafficLight.setYellowTime(config.yellowTime);
+        trafficLight.setGreenTime(config.greenTime);
+        finishLine.setVerbose(config.verbose);
+
+        ghost1.attachToStore(&kartStore);
+        ghost2.attachToStore(&kartStore);
+
+        aiKartCount = config.aiKarts;
+        firstAISlot = kartStore.getCount();
+        aiHeld = false;
+        // At least 8 wide, a square grid for big fields so the back row isn't kilometres behind the start
+        size_t gridColumns = std::max((size_t)8, (size_t)ceil(sqrt((double)aiKartCount)));
+        for (size_t i = 0; i < aiKartCount; i++) {
+            float column = (float)(i % gridColumns) - (gridColumns - 1) * 0.5f;
+            vec3 gridPos(column * 2.0f, 2.0f, -6.0f - (i / gridColumns) * 1.5f);
+            // A spread of speeds between Hare and Turtle so the field doesn't finish as one block
+            float aiMaxSpeed = 0.033f + 0.007f * (i % 8) / 7.0f;
+            float aiAcceleration = 0.00004f + 0.00002f * (i % 5) / 4.0f;
+
+            if (assets.spaceCarVAO != nullptr) {
+                unique_ptr<Kart> aiKart(new Kart(assets.spaceCarVAO, assets.spaceCarTex, assets.objectShader, "AI " + to_string(i), aiMaxSpeed, aiAcceleration));
+                aiKart->setSize(0.25f);
+                aiKart->setPosX(gridPos.x);
+                aiKart->setPosY(gridPos.y);
+                aiKart->setPosZ(gridPos.z);
+                aiKart->attachToStore(&kartStore);
+                aiKarts.push_back(move(aiKart));
+            }
+            else {
+                // Same values a Kart view would register, turningSPD included
+                kartStore.addKart(gridPos, vec3(0.0f, 0.0f, 1.0f), aiMaxSpeed, aiAcceleration, 0.075f);
+            }
+        }
+
+        replayFinished = false;
+        if (!config.replayPath.empty()) {
+            replayKart.reset(new ReplayKart(assets.spaceCarVAO, assets.spaceCarTex, assets.objectShader, config.replayPath, "Replay"));
+            if (replayKart->isValid()) {
+                replayKart->setTransparency(0.1f);
+                replayKart->setSize(0.25f);
+            }
+            else {
+                replayKart.reset();
+            }
+        }
+
+        // The car mesh's bounds when there is one, headless races assume a 2 unit car
+        kartRadius = (assets.spaceCarVAO != nullptr ? assets.spaceCarVAO->getBoundingRadius() : 2.0f) * 0.25f;
+        uint32_t kartMask = COLLISION_PLAYER | COLLISION_AI | COLLISION_PROP;
+        collisionWorld.addEntitySphere(&player, kartRadius, COLLISION_PLAYER, kartMask);
+        collisionWorld.addEntitySphere(&ghost1, kartRadius, COLLISION_GHOST, 0);
+        collisionWorld.addEntitySphere(&ghost2, kartRadius, COLLISION_GHOST, 0);
+        if (replayKart) {
+            collisionWorld.addEntitySphere(replayKart.get(), kartRadius, COLLISION_GHOST, 0);
+        }
+        firstAIProxy = collisionWorld.getProxyCount();
+        for (size_t i = 0; i < aiKarts.size(); i++) {
+            collisionWorld.addEntitySphere(aiKarts[i].get(), kartRadius, COLLISION_AI, kartMask);
+        }
+        if (aiKarts.empty()) {
+            for (size_t slot = firstAISlot; slot < kartStore.getCount(); slot++) {
+                collisionWorld.addStoreSphere(&kartStore, slot, kartRadius, COLLISION_AI, kartMask);
+            }
+        }
 
-        sensitivity = 0.05;
+        // The finish spans the whole ground plane, so it can't be driven around
+        triggers.setFinish(finishLine.getPos(), vec3(0.0f, 0.0f, 1.0f), 750.0f, 50.0f);
+        playerRacer = triggers.addPlayer(&player);
+        ghost1Racer = triggers.addRival(&ghost1);
+        ghost2Racer = triggers.addRival(&ghost2);
+        replayRacer = replayKart ? triggers.addRival(replayKart.get()) : 0;
+        firstAIRacer = (uint32_t)(replayKart ? replayRacer + 1 : ghost2Racer + 1);
+        for (size_t i = 0; i < aiKarts.size(); i++) {
+            triggers.addRival(aiKarts[i].get());
+        }
 
-        POV_Cooldown = 0.5;
-        prevTime = glfwGetTime();
-        POV_3 = true;
-        scrollX = 0.0f;
-        scrollY = 0.0f;
-        mouseX = 0.0f;
-        mouseY = 0.0f;
-        prevMouseX = 0.0f;
-        prevMouseY = 0.0f;
-        thetaX = 180.0f; // To have the camera face the back of the kart instead
-        thetaY = 0.0f;
-        
-        worldUp = normalize(vec3(0.f, 1.f, 0.f)); //Pointing upward
+        raceStarted = false;
+        stopCars = true;
+    }
 
-        pos = vec3(0.0f, 0.0f, 1.0f);
-        cameraGaze = vec3(0.0f, 0.0f, 0.0f); // Gaze is where the camera is looking. In this case 0,0,0 is the center of the Model we are looking at
+    // One sim tick, simTime is the time at the end of the tick
+    void tick(double simTime, const KartInput& playerInput) {
+        TRACE_SCOPE("Race Tick");
+        player.saveState();
+        ghost1.saveState();
+        ghost2.saveState();
+        trafficLight.saveState();
+        for (size_t i = 0; i < aiKarts.size(); i++) {
+            aiKarts[i]->saveState();
+        }
+        if (replayKart) {
+            replayKart->saveState();
+        }
 
-        viewMatrix = lookAt(pos, cameraGaze, worldUp);
+        if (!trafficLight.getStart() && simTime > 6.0) {
+            trafficLight.start(simTime);
+        }
 
-        projectionMatrix = perspective(
-            radians(60.f - pos.z),      //This is your FOV
-            windowHeight / windowWidth, //Aspect ratio
-            0.1f,                       //z-Near, should never be <= 0
-            100.f                       //z-Far   
-        );
-    }
-    void attachParent(PlayerKart* newParent) {
-        parent = newParent;
-    }
-    void getInputs(GLFWwindow* window) {
-        float zoomSpeed = 1.0f;
-        //Mouse Inputs
-        glfwGetCursorPos(window, &mouseX, &mouseY);
+        float tickScale = (float)(SIM_REFERENCE_RATE / config.simRate);
+        player.applyInput(playerInput, tickScale);
 
-        if (mouseX != prevMouseX) {
-            thetaX += (sensitivity * (prevMouseX - mouseX));
-            prevMouseX = mouseX;
+        if (stopCars == false) {
+            ghost1.setAcceleration(config.turtleAcceleration);
+            ghost2.setAcceleration(config.hareAcceleration);
         }
-        if (mouseY != prevMouseY) {
-            thetaY += (sensitivity * (prevMouseY - mouseY));
-            prevMouseY = mouseY;
-            if (thetaY >= 89.0f) {
-                thetaY = 89.0f;
+        else {
+            ghost1.setAcceleration(0.0f);
+            ghost2.setAcceleration(0.0f);
+            ghost1.setSpeed(0.0f);
+            ghost2.setSpeed(0.0f);
+        }
+        if (aiHeld != stopCars) {
+            kartStore.holdFrom(firstAISlot, stopCars);
+            aiHeld = stopCars;
+        }
+
+        {
+            TRACE_SCOPE("Kart Update");
+            kartStore.update(tickScale);
+            ghost1.update(tickScale);
+            ghost2.update(tickScale);
+            for (size_t i = 0; i < aiKarts.size(); i++) {
+                aiKarts[i]->update(tickScale);
             }
-            if (thetaY <= -89.0f) {
-                thetaY = -89.0f;
+
+            player.update(tickScale);
+            if (replayKart) {
+                replayKart->replayTo(simTime);
             }
         }
 
-        if (glfwGetKey(window, GLFW_KEY_Z) == GLFW_PRESS)
         {
-            if (glfwGetTime() - prevTime >= POV_Cooldown) {
-                POV_3 = !POV_3;
-                prevTime = glfwGetTime();
+            TRACE_SCOPE("Traffic Light");
+            trafficLight.update(simTime, tickScale);
+            if (trafficLight.getGreenLight() && !raceStarted) {
+                player.toggleActivation();
+                ghost1.toggleActivation();
+                ghost2.toggleActivation();
+                kartStore.setActiveFrom(firstAISlot, true);
+                if (replayKart) {
+                    replayKart->toggleActivation();
+                }
+                raceStarted = true;
+                stopCars = false;
             }
         }
-        
+
+        {
+            TRACE_SCOPE("Finish Triggers");
+            triggers.update(simTime);
+            handleRaceEvents();
+            // Store-only AI karts (headless, no view to register) skip the triggers and finish on a batched
+            // threshold against the line, they get no checkpoints or laps. 0.25 is the kart length at size 0.25
+            finishedAISlots.clear();
+            if (aiKarts.empty()) {
+                kartStore.finishKarts(firstAISlot, finishLine.getPos().z, 0.25f, simTime, finishedAISlots);
+            }
+            for (size_t i = 0; i < finishedAISlots.size(); i++) {
+                collisionWorld.setEnabled(firstAIProxy + (uint32_t)(finishedAISlots[i] - firstAISlot), false);
+            }
+            if (replayKart && !replayFinished) {
+                replayFinished = triggers.isFinished(replayRacer) || replayKart->isExhausted(simTime);
+            }
+        }
+
+        collisionWorld.update();
     }
 
-    void update(float newWindowWidth, float newWindowHeight) {
-        windowWidth = newWindowWidth;
-        windowHeight = newWindowHeight;
+    // Scenery the karts can hit, the radius is in world units
+    void addProp(Entity3D* prop, float radius) {
+        collisionWorld.addEntitySphere(prop, radius, COLLISION_PROP, COLLISION_PLAYER | COLLISION_AI);
+    }
 
-        if (POV_3 == true) {
-            //Update the tracking position of the camera to the position of its parent, the kart
-            if (parent != nullptr) {
-                cameraGaze.x = parent->getPos().x;
-                cameraGaze.y = parent->getPos().y;
-                cameraGaze.z = parent->getPos().z;
-            }
-            //  3rd person camera movement (Thin Matrix, 2024)
-            float groundDist = distanceFromFocus * cos(radians(thetaY));
-            pos = vec3(
-                cameraGaze.x + (groundDist * sin(radians(thetaX))),
-                cameraGaze.y + (-distanceFromFocus * sin(radians(thetaY))),
-                cameraGaze.z + (groundDist * cos(radians(thetaX)))
-            );
+    // Space key, stops or releases the ghosts
+    void toggleStopCars() {
+        stopCars = !stopCars;
+    }
+
+    // All karts past the finish line
+    bool isFinished() const {
+        return triggers.isFinished(playerRacer) && triggers.isFinished(ghost1Racer) && triggers.isFinished(ghost2Racer) && kartStore.getFinishedCount() == aiKartCount
+            && (!replayKart || replayFinished);
+    }
+
+    // The AI field is summarized instead of ranked, it can be far too large to print kart by kart
+    void printAIResults() const {
+        if (aiKartCount == 0) {
+            return;
         }
-        else{
-            if (parent != nullptr) {
-                pos = vec3(parent->getPos().x, parent->getPos().y + 0.15f, parent->getPos().z);
-                cameraGaze = vec3(pos + parent->getDir());
+        double bestTime = 0.0, totalTime = 0.0;
+        for (size_t slot = firstAISlot; slot < kartStore.getCount(); slot++) {
+            if (kartStore.isFinished(slot)) {
+                double time = kartStore.getFinishTime(slot);
+                bestTime = (totalTime == 0.0) ? time : std::min(bestTime, time);
+                totalTime += time;
             }
         }
+        size_t finishedCount = kartStore.getFinishedCount();
+        cout << "AI: Karts : " << aiKartCount << " : Finished : " << finishedCount;
+        if (finishedCount > 0) {
+            cout << " : Best Time : " << bestTime << " : Mean Time : " << totalTime / finishedCount;
+        }
+        cout << endl;
+    }
 
+    const vector<unique_ptr<Kart>>& getAIKarts() const {
+        return aiKarts;
+    }
+    const vector<FinishResult>& getResults() const {
+        return finishLine.getResults();
+    }
+    const CollisionWorld& getCollisionWorld() const {
+        return collisionWorld;
+    }
+    // Null unless the race was given a valid replay
+    ReplayKart* getReplayKart() {
+        return replayKart.get();
+    }
+    const RaceConfig& getConfig() const {
+        return config;
+    }
 
-        projectionMatrix = perspective(
-            radians(80.0f),      //This is your FOV
-            windowHeight / windowWidth, //Aspect ratio
-            0.1f,                       //z-Near, should never be <= 0
-            10000.f                       //z-Far   
-        );
-        viewMatrix = lookAt(pos, cameraGaze, worldUp);
+    PlayerKart& getPlayer() {
+        return player;
     }
-    void setZoom(float newZoom) {
-        distanceFromFocus = newZoom;
+    Kart& getGhost1() {
+        return ghost1;
+    }
+    Kart& getGhost2() {
+        return ghost2;
+    }
+    TrafficLight& getTrafficLight() {
+        return trafficLight;
+    }
+    PointLight& getTrafficPointLight() {
+        return trafficPointLight;
+    }
+    FinishLine& getFinishLine() {
+        return finishLine;
     }
 };
 
-class Skybox {
+/* Fixed timestep scheduler
+*  Real frame time goes into an accumulator and the sim steps in fixed ticks until it has caught up,
+*  so kart speeds and race times are the same at any frame rate. The leftover part of a tick is
+*  the interpolation factor rendering uses to blend the last two sim states
+*/
+class FixedTimestep {
 private:
-    const char* sky_v;
-    const char* sky_f;
-    GLuint sky_vertexShader;
-    GLuint sky_fragShader;
-    GLuint sky_shaderProg;
-    unsigned int skyboxVAO, skyboxVBO, skyboxEBO;
-    unsigned int skyboxTex;
-    mat4 sky_view;
+    double step;
+    double accumulator;
+    double simTime;
+    double lastRealTime;
+    bool started;
+    // A long hitch (window drag, breakpoint) would otherwise be replayed as a burst of ticks
+    double maxFrameTime;
 
 public:
-    Skybox(string skyboxShaderV, string skyboxShaderF, string dayNight) {
-        sky_shaderProg = glCreateProgram();
-        fstream sky_vertSrc(skyboxShaderV);
-        stringstream sky_vertBuff;
-        sky_vertBuff << sky_vertSrc.rdbuf();
-        string sky_vertS = sky_vertBuff.str();
-        sky_v = sky_vertS.c_str();
-
-        fstream sky_fragSrc(skyboxShaderF);
-        stringstream sky_fragBuff;
-        sky_fragBuff << sky_fragSrc.rdbuf();
-        string sky_fragS = sky_fragBuff.str();
-        sky_f = sky_fragS.c_str();
-
-        GLuint sky_vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(sky_vertexShader, 1, &sky_v, NULL);
-        glCompileShader(sky_vertexShader);
-
-        GLuint sky_fragShader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(sky_fragShader, 1, &sky_f, NULL);
-        glCompileShader(sky_fragShader);
-
-        glAttachShader(sky_shaderProg, sky_vertexShader);
-        glAttachShader(sky_shaderProg, sky_fragShader);
-        glLinkProgram(sky_shaderProg);
+    FixedTimestep(double ticksPerSecond) {
+        step = 1.0 / ticksPerSecond;
+        accumulator = 0.0;
+        simTime = 0.0;
+        lastRealTime = 0.0;
+        started = false;
+        maxFrameTime = 0.25;
+    }
 
-        float skyboxVertices[]{
-            -1.f, -1.f, 1.f, //0
-            1.f, -1.f, 1.f,  //1
-            1.f, -1.f, -1.f, //2
-            -1.f, -1.f, -1.f,//3
-            -1.f, 1.f, 1.f,  //4
-            1.f, 1.f, 1.f,   //5
-            1.f, 1.f, -1.f,  //6
-            -1.f, 1.f, -1.f  //7
-        };
+    void beginFrame(double realTime) {
+        if (!started) {
+            lastRealTime = realTime;
+            started = true;
+        }
+        accumulator += std::min(realTime - lastRealTime, maxFrameTime);
+        lastRealTime = realTime;
+    }
 
-        //Skybox Indices
-        unsigned int skyboxIndices[]{
-            1,2,6,
-            6,5,1,
+    // True while a tick is due, advances the sim clock by one step each time
+    bool consumeTick() {
+        if (accumulator < step) {
+            return false;
+        }
+        accumulator -= step;
+        simTime += step;
+        return true;
+    }
 
-            0,4,7,
-            7,3,0,
+    float getInterpolation() const {
+        return (float)(accumulator / step);
+    }
+    double getSimTime() const {
+        return simTime;
+    }
+    double getStep() const {
+        return step;
+    }
+};
 
-            4,5,6,
-            6,7,4,
+/* Command line options
+*  --sim-rate <hz>        sim ticks per second, the per tick kart and animation constants are scaled from 60
+*  --uncapped             disables vsync, the sim still runs at the sim rate
+*  --headless             runs the race with no window or GL context, as fast as the CPU allows
+*  --max-sim-time <sec>   headless only, gives up on a race that hasn't finished by then
+*  --ai-karts <count>     adds an AI field behind the named karts
+*  --batch <races>        runs that many headless races with jittered ghost and traffic light tuning
+*  --seed <seed>          seed of the first batch race, race i uses seed + i
+*  --threads <count>      batch worker threads, every core by default
+*  --batch-out <file>     CSV the batch results are written to
+*  --record <file>        records the player's kart every sim tick and saves it when the race ends
+*  --replay <file>        races against a recording as an extra ghost
+*/
+struct LaunchOptions {
+    double simRate = 60.0;
+    bool uncapped = false;
+    bool headless = false;
+    double maxSimTime = 600.0;
+    size_t aiKarts = 0;
+    size_t batchRaces = 0;
+    uint64_t seed = 1;
+    size_t threads = 0;
+    string batchOut = "batch_results.csv";
+    string recordPath;
+    string replayPath;
+    // Offscreen runs draw a fixed number of frames into an FBO, optionally saving every dumpEvery'th one
+    bool offscreen = false;
+    size_t frames = 600;
+    string dumpDir;
+    size_t dumpEvery = 1;
+    // Benchmarks play a scripted timeline instead of mouse and keyboard, and write their results as JSON
+    string benchmarkScript;
+    string benchmarkOut = "benchmark.json";
+    // Chrome trace of the profiled scopes, written when the game, headless race or batch ends
+    string tracePath;
+};
 
-            0,3,2,
-            2,1,0,
+bool parseLaunchOptions(int argc, char** argv, LaunchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--sim-rate" && i + 1 < argc) {
+            options.simRate = atof(argv[++i]);
+            if (options.simRate <= 0.0) {
+                cout << "OPTIONS: --sim-rate must be positive" << endl;
+                return false;
+            }
+        }
+        else if (arg == "--uncapped") {
+            options.uncapped = true;
+        }
+        else if (arg == "--headless") {
+            options.headless = true;
+        }
+        else if (arg == "--max-sim-time" && i + 1 < argc) {
+            options.maxSimTime = atof(argv[++i]);
+        }
+        else if (arg == "--ai-karts" && i + 1 < argc) {
+            options.aiKarts = (size_t)std::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "--batch" && i + 1 < argc) {
+            options.batchRaces = (size_t)std::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "--seed" && i + 1 < argc) {
+            options.seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            options.threads = (size_t)std::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "--batch-out" && i + 1 < argc) {
+            options.batchOut = argv[++i];
+        }
+        else if (arg == "--record" && i + 1 < argc) {
+            options.recordPath = argv[++i];
+        }
+        else if (arg == "--replay" && i + 1 < argc) {
+            options.replayPath = argv[++i];
+        }
+        else if (arg == "--offscreen") {
+            options.offscreen = true;
+        }
+        else if (arg == "--frames" && i + 1 < argc) {
+            options.frames = (size_t)std::max(atoi(argv[++i]), 0);
+        }
+        else if (arg == "--dump-frames" && i + 1 < argc) {
+            options.dumpDir = argv[++i];
+        }
+        else if (arg == "--dump-every" && i + 1 < argc) {
+            options.dumpEvery = (size_t)std::max(atoi(argv[++i]), 1);
+        }
+        else if (arg == "--benchmark" && i + 1 < argc) {
+            options.benchmarkScript = argv[++i];
+        }
+        else if (arg == "--benchmark-out" && i + 1 < argc) {
+            options.benchmarkOut = argv[++i];
+        }
+        else if (arg == "--trace" && i + 1 < argc) {
+            options.tracePath = argv[++i];
+        }
+        else {
+            cout << "OPTIONS: unknown option " << arg << endl;
+            cout << "Usage: KartingGame [--sim-rate <hz>] [--uncapped] [--headless] [--max-sim-time <sec>] [--ai-karts <count>]"
+                << " [--batch <races>] [--seed <seed>] [--threads <count>] [--batch-out <file>]"
+                << " [--record <file>] [--replay <file>]"
+                << " [--offscreen] [--frames <count>] [--dump-frames <dir>] [--dump-every <n>]"
+                << " [--benchmark <script>] [--benchmark-out <file>] [--trace <file>]" << endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-            0,1,5,
-            5,4,0,
+/* Offscreen rendering
+*  A surfaceless EGL context drawing into an FBO, so the game can render on machines with no display or GPU
+*  (Mesa's llvmpipe works). Only available when built with KARTING_WITH_EGL, otherwise isValid is always false
+*/
+class OffscreenContext {
+private:
+#ifdef KARTING_WITH_EGL
+    EGLDisplay display;
+    EGLContext context;
+#endif
+    GLuint framebuffer, colorBuffer, depthBuffer;
+    int width, height;
+    bool valid;
 
-            3,7,6,
-            6,2,3
+public:
+    OffscreenContext(int newWidth, int newHeight) {
+        width = newWidth;
+        height = newHeight;
+        valid = false;
+        framebuffer = colorBuffer = depthBuffer = 0;
+#ifdef KARTING_WITH_EGL
+        display = EGL_NO_DISPLAY;
+        context = EGL_NO_CONTEXT;
+
+        // Mesa's surfaceless platform needs no X or Wayland server, other drivers fall back to their default display
+        PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+        if (getPlatformDisplay != nullptr) {
+            display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+        }
+        if (display == EGL_NO_DISPLAY) {
+            display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        }
+        EGLint major = 0, minor = 0;
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor)) {
+            cout << "OFFSCREEN: no EGL display" << endl;
+            return;
+        }
+        eglBindAPI(EGL_OPENGL_API);
+
+        // Surface type defaults to windows, which a surfaceless display has none of
+        const EGLint configAttribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+        EGLConfig config;
+        EGLint configCount = 0;
+        if (!eglChooseConfig(display, configAttribs, &config, 1, &configCount) || configCount == 0) {
+            cout << "OFFSCREEN: no EGL config for desktop GL" << endl;
+            return;
+        }
+        // Same version and profile the window asks glfw for
+        const EGLint contextAttribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION, 3,
+            EGL_CONTEXT_MINOR_VERSION, 3,
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+            EGL_NONE
         };
+        context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+        if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+            cout << "OFFSCREEN: could not create a surfaceless GL 3.3 context" << endl;
+            return;
+        }
+        if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress)) {
+            cout << "OFFSCREEN: could not load GL" << endl;
+            return;
+        }
 
-        glGenVertexArrays(1, &skyboxVAO);
-        glGenBuffers(1, &skyboxVBO);
+        // Everything draws into this FBO, it stays bound for the whole run
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glGenRenderbuffers(1, &colorBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer);
+        glGenRenderbuffers(1, &depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, depthBuffer);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthBuffer);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            cout << "OFFSCREEN: framebuffer incomplete" << endl;
+            return;
+        }
+        valid = true;
+        cout << "OFFSCREEN: EGL " << major << "." << minor << " : Renderer : " << (const char*)glGetString(GL_RENDERER) << endl;
+#else
+        cout << "OFFSCREEN: not available, build with KARTING_WITH_EGL" << endl;
+#endif
+    }
 
-        glBindVertexArray(skyboxVAO);
-        glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(GLfloat), (void*)0);
+    ~OffscreenContext() {
+#ifdef KARTING_WITH_EGL
+        if (valid) {
+            glDeleteFramebuffers(1, &framebuffer);
+            glDeleteRenderbuffers(1, &colorBuffer);
+            glDeleteRenderbuffers(1, &depthBuffer);
+        }
+        if (display != EGL_NO_DISPLAY) {
+            eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+            if (context != EGL_NO_CONTEXT) {
+                eglDestroyContext(display, context);
+            }
+            eglTerminate(display);
+        }
+#endif
+    }
 
-        glGenBuffers(1, &skyboxEBO);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, skyboxEBO);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLint) * 36, &skyboxIndices, GL_STATIC_DRAW);
-        glEnableVertexAttribArray(0);
+    bool isValid() const {
+        return valid;
+    }
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindVertexArray(0);
+    // Binary PPM of what has been drawn so far, flipped so the first row is the top of the image
+    bool savePPM(const string& filePath) {
+        vector<unsigned char> pixels((size_t)width * height * 3);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
 
-        string facesSkybox[6];
-        if (dayNight == "day") {
-            facesSkybox[0] = "Skybox/Morning/right.png";
-            facesSkybox[1] = "Skybox/Morning/left.png";
-            facesSkybox[2] = "Skybox/Morning/top.png";
-            facesSkybox[3] = "Skybox/Morning/bottom.png";
-            facesSkybox[4] = "Skybox/Morning/front.png";
-            facesSkybox[5] = "Skybox/Morning/back.png";
+        ofstream image(filePath, ios::binary | ios::trunc);
+        if (!image) {
+            return false;
+        }
+        image << "P6\n" << width << " " << height << "\n255\n";
+        for (int y = height - 1; y >= 0; y--) {
+            image.write((const char*)&pixels[(size_t)y * width * 3], (streamsize)width * 3);
+        }
+        return image.good();
+    }
+};
 
+// Text as the contents of a JSON string, Windows paths bring backslashes and drivers can report anything
+string escapeJson(const string& text) {
+    string escaped;
+    escaped.reserve(text.size());
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += (char)c;
+        }
+        else if (c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        }
+        else {
+            escaped += (char)c;
         }
+    }
+    return escaped;
+}
+
+/* Benchmark script
+*  A timeline that stands in for the mouse and keyboard, so a benchmark draws the same frames every run.
+*  One command per line, times are seconds on the benchmark's fixed 1/60s frame clock, # starts a comment:
+*      frames <count>                          frames to draw, --frames when left out
+*      <time> camera <thetaX> <thetaY> <zoom>  camera orbit key, interpolated linearly between keys
+*      <time> input <throttle> <brake> <left> <right>   player keys (0/1), held until the next input line
+*      <time> day | night                      skybox and lighting
+*      <time> stop-cars                        same as pressing space
+*/
+class BenchmarkScript {
+public:
+    enum EventType {
+        EVENT_DAY,
+        EVENT_NIGHT,
+        EVENT_STOP_CARS
+    };
+
+    struct Event {
+        double time;
+        EventType type;
+    };
+
+private:
+    struct CameraKey {
+        double time;
+        float thetaX, thetaY, zoom;
+    };
+
+    struct InputKey {
+        double time;
+        KartInput input;
+    };
 
-        else if (dayNight == "evening") {
-            facesSkybox[0] = "Skybox/Night/right.png";
-            facesSkybox[1] = "Skybox/Night/left.png";
-            facesSkybox[2] = "Skybox/Night/top.png";
-            facesSkybox[3] = "Skybox/Night/bottom.png";
-            facesSkybox[4] = "Skybox/Night/front.png";
-            facesSkybox[5] = "Skybox/Night/back.png";
+    size_t frames = 0;
+    vector<CameraKey> cameraKeys;
+    vector<InputKey> inputKeys;
+    vector<Event> events;
+    size_t nextEvent = 0;
 
+public:
+    bool load(const string& filePath) {
+        ifstream script(filePath);
+        if (!script) {
+            cout << "BENCHMARK: could not open " << filePath << endl;
+            return false;
         }
+        string line;
+        int lineNumber = 0;
+        while (getline(script, line)) {
+            lineNumber++;
+            size_t comment = line.find('#');
+            if (comment != string::npos) {
+                line.erase(comment);
+            }
+            istringstream words(line);
+            string first;
+            if (!(words >> first)) {
+                continue;
+            }
+            if (first == "frames") {
+                if (!(words >> frames)) {
+                    cout << "BENCHMARK: " << filePath << ":" << lineNumber << " : frames needs a count" << endl;
+                    return false;
+                }
+                continue;
+            }
 
-        glGenTextures(1, &skyboxTex);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, skyboxTex);
+            double time = atof(first.c_str());
+            string command;
+            words >> command;
+            bool valid = true;
+            if (command == "camera") {
+                CameraKey key = { time, 0.0f, 0.0f, 0.0f };
+                valid = (bool)(words >> key.thetaX >> key.thetaY >> key.zoom);
+                cameraKeys.push_back(key);
+            }
+            else if (command == "input") {
+                int throttle = 0, brake = 0, left = 0, right = 0;
+                valid = (bool)(words >> throttle >> brake >> left >> right);
+                InputKey key;
+                key.time = time;
+                key.input.throttle = throttle != 0;
+                key.input.brake = brake != 0;
+                key.input.left = left != 0;
+                key.input.right = right != 0;
+                inputKeys.push_back(key);
+            }
+            else if (command == "day" || command == "night" || command == "stop-cars") {
+                Event event = { time, command == "day" ? EVENT_DAY : (command == "night" ? EVENT_NIGHT : EVENT_STOP_CARS) };
+                events.push_back(event);
+            }
+            else {
+                valid = false;
+            }
+            if (!valid) {
+                cout << "BENCHMARK: " << filePath << ":" << lineNumber << " : could not read \"" << line << "\"" << endl;
+                return false;
+            }
+        }
 
-        // Alleviates the quality of the texture 200px -> 2000px
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        // Alleviates the quality of the texture 2000px -> 200px
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        // Keys can be written in any order, lookups expect them sorted
+        sort(cameraKeys.begin(), cameraKeys.end(), [](const CameraKey& a, const CameraKey& b) { return a.time < b.time; });
+        stable_sort(inputKeys.begin(), inputKeys.end(), [](const InputKey& a, const InputKey& b) { return a.time < b.time; });
+        stable_sort(events.begin(), events.end(), [](const Event& a, const Event& b) { return a.time < b.time; });
+        return true;
+    }
 
-        //UV == Tex
-        //ST == Face of the 3D Model
-        //RST== Cubemap
+    // 0 when the script leaves it to --frames
+    size_t getFrames() const {
+        return frames;
+    }
 
-        //Makes sure the texture is stretched to the edge
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    // False when the script has no camera keys, the camera is then left alone
+    bool getCamera(double time, float& thetaX, float& thetaY, float& zoom) const {
+        if (cameraKeys.empty()) {
+            return false;
+        }
+        size_t next = 0;
+        while (next < cameraKeys.size() && cameraKeys[next].time <= time) {
+            next++;
+        }
+        const CameraKey& from = cameraKeys[next == 0 ? 0 : next - 1];
+        const CameraKey& to = cameraKeys[std::min(next, cameraKeys.size() - 1)];
+        float blend = to.time > from.time ? (float)((time - from.time) / (to.time - from.time)) : 0.0f;
+        blend = glm::clamp(blend, 0.0f, 1.0f);
+        thetaX = mix(from.thetaX, to.thetaX, blend);
+        thetaY = mix(from.thetaY, to.thetaY, blend);
+        zoom = mix(from.zoom, to.zoom, blend);
+        return true;
+    }
+
+    KartInput getInput(double time) const {
+        KartInput input;
+        for (size_t i = 0; i < inputKeys.size() && inputKeys[i].time <= time; i++) {
+            input = inputKeys[i].input;
+        }
+        return input;
+    }
 
-        for (unsigned int i = 0; i < 6; i++) {
-            int w, h, skyCChannel;
-            stbi_set_flip_vertically_on_load(false);
-            unsigned char* data = stbi_load(
-                facesSkybox[i].c_str(),
-                &w,
-                &h,
-                &skyCChannel,
-                0
-            );
-            if (data) {
-                if (skyCChannel==3){
-                    glTexImage2D(
-                        GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                        0,
-                        GL_RGB,
-                        w,
-                        h,
-                        0,
-                        GL_RGB,
-                        GL_UNSIGNED_BYTE,
-                        data
-                    );
-                }
-                if (skyCChannel == 4) {
-                    glTexImage2D(
-                        GL_TEXTURE_CUBE_MAP_POSITIVE_X + i,
-                        0,
-                        GL_RGBA,
-                        w,
-                        h,
-                        0,
-                        GL_RGBA,
-                        GL_UNSIGNED_BYTE,
-                        data
-                    );
-                }
-            }
-            stbi_image_free(data);
+    // Events due by time that have not been returned yet, in script order
+    bool popEvent(double time, Event& event) {
+        if (nextEvent >= events.size() || events[nextEvent].time > time) {
+            return false;
         }
-        stbi_set_flip_vertically_on_load(true);
+        event = events[nextEvent++];
+        return true;
     }
-    ~Skybox() {
-        glDeleteShader(sky_vertexShader);
-        glDeleteShader(sky_fragShader);
-        glDeleteVertexArrays(1, &skyboxVAO);
-        glDeleteBuffers(1, &skyboxVBO);
-        glDeleteBuffers(1, &skyboxEBO);
+};
+
+/* Benchmark results
+*  Per frame samples, summarized as percentiles so runs can be compared
+*/
+class BenchmarkRecorder {
+private:
+    vector<double> frameMs;
+    vector<double> draws, triangles, stateChanges;
+
+    // Nearest rank percentile, samples must be sorted
+    static double percentile(const vector<double>& sorted, double fraction) {
+        if (sorted.empty()) {
+            return 0.0;
+        }
+        size_t rank = (size_t)ceil(fraction * sorted.size());
+        return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
     }
-    void draw(PerspectiveCamera perspectiveCamera) {
-        glDepthMask(GL_FALSE);
-        glDepthFunc(GL_LEQUAL);
-        glUseProgram(sky_shaderProg);
 
-        sky_view = mat4(1.f);
-        sky_view = mat4( //Retain orientation
-            mat3(perspectiveCamera.getViewMatrix()) //Removes the position components
-        );
+    static void writeSummary(ostream& out, const string& name, vector<double> samples, bool last) {
+        sort(samples.begin(), samples.end());
+        double total = 0.0;
+        for (size_t i = 0; i < samples.size(); i++) {
+            total += samples[i];
+        }
+        out << "    \"" << name << "\": { \"mean\": " << (samples.empty() ? 0.0 : total / samples.size())
+            << ", \"p50\": " << percentile(samples, 0.50)
+            << ", \"p95\": " << percentile(samples, 0.95)
+            << ", \"p99\": " << percentile(samples, 0.99)
+            << ", \"max\": " << (samples.empty() ? 0.0 : samples.back()) << " }" << (last ? "\n" : ",\n");
+    }
 
-        unsigned int sky_projectionLoc = glGetUniformLocation(sky_shaderProg, "projection");
-        glUniformMatrix4fv(sky_projectionLoc, 1, GL_FALSE, value_ptr(perspectiveCamera.getProjectionMatrix()));
+public:
+    void addFrame(double newFrameMs, const RenderQueue::Stats& stats) {
+        frameMs.push_back(newFrameMs);
+        draws.push_back(stats.draws);
+        triangles.push_back(stats.triangles);
+        stateChanges.push_back(stats.shaderBinds + stats.materialBinds + stats.vaoBinds);
+    }
 
-        unsigned int sky_viewLoc = glGetUniformLocation(sky_shaderProg, "view");
-        glUniformMatrix4fv(sky_viewLoc, 1, GL_FALSE, value_ptr(sky_view));
+    bool write(const string& filePath, const string& scriptPath) const {
+        ofstream out(filePath, ios::trunc);
+        if (!out) {
+            return false;
+        }
+        const char* renderer = (const char*)glGetString(GL_RENDERER);
+        out << setprecision(6);
+        out << "{\n";
+        out << "  \"script\": \"" << escapeJson(scriptPath) << "\",\n";
+        out << "  \"renderer\": \"" << escapeJson(renderer != nullptr ? renderer : "unknown") << "\",\n";
+        out << "  \"frames\": " << frameMs.size() << ",\n";
+        out << "  \"perFrame\": {\n";
+        writeSummary(out, "frameMs", frameMs, false);
+        writeSummary(out, "drawCalls", draws, false);
+        writeSummary(out, "triangles", triangles, false);
+        writeSummary(out, "stateChanges", stateChanges, true);
+        out << "  }\n";
+        out << "}\n";
+        return out.good();
+    }
 
-        glBindVertexArray(skyboxVAO);
-        glBindTexture(GL_TEXTURE_CUBE_MAP, skyboxTex);
-        glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, 0);
-        glDepthMask(GL_TRUE);
-        glDepthFunc(GL_LESS);
+    void print() const {
+        vector<double> sorted = frameMs;
+        sort(sorted.begin(), sorted.end());
+        cout << "BENCHMARK: Frames : " << sorted.size()
+            << " : p50 : " << percentile(sorted, 0.50) << "ms"
+            << " : p95 : " << percentile(sorted, 0.95) << "ms"
+            << " : p99 : " << percentile(sorted, 0.99) << "ms" << endl;
     }
 };
 
-class TrafficLight:public Model3D{
+/* Work stealing thread pool
+*  Every worker owns a deque of task indices. It takes work from the back of its own deque and, once that
+*  is empty, steals from the front of the others'. All tasks are queued before the workers start, so a
+*  worker that finds every deque empty is done
+*/
+class WorkStealingPool {
 private:
-    bool startSequence, endSequence;
-    double sequenceTime, startTime;
-    float glow, rotateSPD;
-    bool greenLight;
-    double redTime, yellowTime, greenTime;
-    PointLight* childPointLight;
-    float half;
-    float r;
-    float g;
-    float b;
-public:
-    TrafficLight(VAO* newModelVao, Texture* newTexture, Shader* newShader, PointLight* newChildPointLight) {
-        modelVAO = newModelVao;
-        texture = newTexture;
-        modelShader = newShader;
-        childPointLight = newChildPointLight;
-        identity_matrix = mat4(1.0f);
-        transparency = 1.0f;
+    struct WorkQueue {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+    vector<unique_ptr<WorkQueue>> queues;
 
-        childPointLight->setRGB(vec3(10,10,10));
-        childPointLight->setLumens(4000.f);
-        redTime = 100.0;
-        yellowTime = 150.0;
-        greenTime = 250.0;
-        sequenceTime = 0.0f;
-        startTime = 0.0f;
-        startSequence = false;
-        endSequence = false;
-        greenLight = false;
-        glow = 0.0f;
-        rotateSPD = 0.15f;
+    bool popLocal(size_t worker, size_t& task) {
+        WorkQueue& queue = *queues[worker];
+        lock_guard<mutex> guard(queue.lock);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = queue.tasks.back();
+        queue.tasks.pop_back();
+        return true;
+    }
 
-        half = 254/2;
-        r = 0;
-        g = 0;
-        b = 0;
+    bool steal(size_t thief, size_t& task) {
+        for (size_t offset = 1; offset < queues.size(); offset++) {
+            WorkQueue& victim = *queues[(thief + offset) % queues.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
     }
-    void setRedTime(double newRedTime) {
-        redTime = newRedTime;
+
+public:
+    WorkStealingPool(size_t workerCount) {
+        for (size_t i = 0; i < std::max(workerCount, (size_t)1); i++) {
+            queues.push_back(unique_ptr<WorkQueue>(new WorkQueue()));
+        }
     }
-    void setYellowTime(double newYellowTime) {
-        yellowTime = newYellowTime;
+
+    size_t getWorkerCount() const {
+        return queues.size();
     }
-    void setGreenTime(double newGreenTime) {
-        greenTime = newGreenTime;
+
+    // Calls task(i) for every i in [0, taskCount) across the workers, returns once all of them are done
+    void run(size_t taskCount, const function<void(size_t)>& task) {
+        for (size_t i = 0; i < taskCount; i++) {
+            queues[i % queues.size()]->tasks.push_back(i);
+        }
+
+        vector<thread> workers;
+        for (size_t worker = 0; worker < queues.size(); worker++) {
+            workers.emplace_back([this, worker, &task]() {
+                TRACE_THREAD_NAME("Pool Worker");
+                size_t next;
+                while (popLocal(worker, next) || steal(worker, next)) {
+                    task(next);
+                }
+            });
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            workers[i].join();
+        }
     }
-    void start() {
-        startSequence = true;
-        startTime = glfwGetTime();
+};
+
+void recordPlayer(ReplayRecorder& recorder, Race& race) {
+    PlayerKart& player = race.getPlayer();
+    recorder.record(player.getPos(), player.getTheta(), player.getSpeed());
+}
+
+void saveTrace(const string& filePath, const GpuProfiler* gpuProfiler) {
+    if (writeChromeTrace(filePath, gpuProfiler)) {
+        cout << "TRACE: wrote " << filePath << endl;
     }
-    void end() {
-        endSequence = true;
-        rotateSPD=0.01;
-        childPointLight->setLumens(75000.0f *glow);
-        childPointLight->setRGB(vec3(r, g, b));
+    else {
+        cout << "TRACE: could not write " << filePath << endl;
     }
-    bool getGreenLight() {
-        return greenLight;
+}
+
+void saveRecording(const ReplayRecorder& recorder, string filePath) {
+    if (recorder.save(filePath)) {
+        cout << "REPLAY: Recorded " << recorder.getTickCount() << " ticks : Bytes : " << recorder.getByteSize()
+            << " : Saved to " << filePath << endl;
     }
-    bool getStart() {
-        return startSequence;
+    else {
+        cout << "REPLAY: could not write " << filePath << endl;
     }
-    void update(double currentTime) {
-        childPointLight->setPosX(pos.x);
-        childPointLight->setPosY(pos.y);
-        childPointLight->setPosZ(pos.z);
+}
 
-        glow = 1.25+cos(currentTime*rotateSPD);
+/* Headless race
+*  No window, no GL context and no wall clock: the sim time is a tick counter, so a race takes
+*  as long as the CPU needs to step it. The player is on autopilot and holds the throttle
+*  Returns the sim time the race stopped at
+*/
+double runRaceToEnd(Race& race, double simRate, double maxSimTime, uint64_t& ticks, ReplayRecorder* recorder = nullptr) {
+    KartInput autopilot;
+    autopilot.throttle = true;
+
+    double step = 1.0 / simRate;
+    double simTime = 0.0;
+    ticks = 0;
+    while (!race.isFinished() && simTime < maxSimTime) {
+        ticks++;
+        simTime = ticks * step;
+        race.tick(simTime, autopilot);
+        if (recorder != nullptr) {
+            recordPlayer(*recorder, race);
+        }
+    }
+    return simTime;
+}
 
-        r = half + (half * sin(currentTime * 1.25));
-        g = half + (half * cos(currentTime * 1.35));
-        b = half + (half * sin(currentTime * 1.45));
+int runHeadless(const LaunchOptions& options) {
+    RaceConfig config;
+    config.aiKarts = options.aiKarts;
+    config.replayPath = options.replayPath;
+    config.simRate = options.simRate;
+    Race race(RaceAssets(), config);
 
+    bool recording = !options.recordPath.empty();
+    ReplayRecorder recorder(options.simRate);
 
-        if (!greenLight) {
-            size.x = (half + (b*0.25f)) * 0.35;
-            size.y = (half + (g*0.085f)) * 0.35;
-            size.z = (half + (r*0.25f)) * 0.35;
-        }
+    uint64_t ticks = 0;
+    chrono::steady_clock::time_point wallStart = chrono::steady_clock::now();
+    double simTime = runRaceToEnd(race, options.simRate, options.maxSimTime, ticks, recording ? &recorder : nullptr);
+    double wallTime = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
 
-        theta.x += rotateSPD *0.25f;
-        theta.y += rotateSPD;
-        theta.z += rotateSPD *0.005;
+    if (!race.isFinished()) {
+        cout << "HEADLESS: Race did not finish within " << options.maxSimTime << "s" << endl;
+    }
+    race.printAIResults();
+    race.getCollisionWorld().printStats();
+    if (recording) {
+        saveRecording(recorder, options.recordPath);
+    }
+    if (!options.tracePath.empty()) {
+        saveTrace(options.tracePath, nullptr);
+    }
+    cout << "HEADLESS: Sim Time : " << simTime << "s : Ticks : " << ticks
+        << " : Wall Time : " << wallTime << "s" << endl;
+    return race.isFinished() ? 0 : 1;
+}
 
-        if (startSequence) {
-            sequenceTime = currentTime - startTime;
-            if (sequenceTime <= redTime) {
-                rotateSPD+=0.0001f;
-                childPointLight->setLumens(40000.0f*glow);
-                childPointLight->setRGB(vec3(255, 0, 0));
+/* Batch runner
+*  Independent headless races, one per seed, spread over a work stealing pool. Every race owns all
+*  of its state, so workers share nothing but the result slots, each written by exactly one race
+*  The jitter comes from mt19937_64, results are reproducible for a seed on the same standard library
+*/
+RaceConfig makeBatchConfig(uint64_t seed, size_t aiKarts) {
+    RaceConfig config;
+    mt19937_64 rng(seed);
+    uniform_real_distribution<float> tuningJitter(0.9f, 1.1f);
+    uniform_real_distribution<double> timingJitter(0.8, 1.2);
+
+    config.seed = seed;
+    config.turtleMaxSpeed *= tuningJitter(rng);
+    config.turtleAcceleration *= tuningJitter(rng);
+    config.hareMaxSpeed *= tuningJitter(rng);
+    config.hareAcceleration *= tuningJitter(rng);
+    config.redTime *= timingJitter(rng);
+    config.yellowTime *= timingJitter(rng);
+    config.greenTime *= timingJitter(rng);
+    config.aiKarts = aiKarts;
+    config.verbose = false;
+    return config;
+}
+
+int runBatch(const LaunchOptions& options) {
+    size_t raceCount = options.batchRaces;
+    vector<RaceConfig> configs(raceCount);
+    vector<vector<FinishResult>> results(raceCount);
+    for (size_t i = 0; i < raceCount; i++) {
+        configs[i] = makeBatchConfig(options.seed + i, options.aiKarts);
+        configs[i].simRate = options.simRate;
+    }
+
+    size_t threadCount = options.threads > 0 ? options.threads : std::max(thread::hardware_concurrency(), 1u);
+    WorkStealingPool pool(threadCount);
+
+    chrono::steady_clock::time_point wallStart = chrono::steady_clock::now();
+    pool.run(raceCount, [&](size_t i) {
+        Race race(RaceAssets(), configs[i]);
+        uint64_t ticks = 0;
+        runRaceToEnd(race, options.simRate, options.maxSimTime, ticks);
+
+        // Karts that never crossed the line are kept as DNF rows, rank 0
+        results[i] = race.getResults();
+        const Kart* namedKarts[] = { &race.getPlayer(), &race.getGhost1(), &race.getGhost2() };
+        for (const Kart* kart : namedKarts) {
+            bool finished = false;
+            for (size_t r = 0; r < results[i].size(); r++) {
+                finished = finished || results[i][r].name == kart->getName();
             }
-            else if (sequenceTime<=redTime + yellowTime) {
-                rotateSPD+=0.00075f;
-                childPointLight->setLumens(65000.0f*glow);
-                childPointLight->setRGB(vec3(255, 200, 0));
+            if (!finished) {
+                FinishResult dnf = { kart->getName(), 0, 0.0 };
+                results[i].push_back(dnf);
             }
-            else if (sequenceTime <=redTime + yellowTime + greenTime) {
-                rotateSPD=0;
-                setSize(pos.y * 0.3f);
-                theta = vec3(0, 0, 0);
-                childPointLight->setLumens(75000.0f*glow);
-                childPointLight->setRGB(vec3(0, 255, 0));
-                greenLight = true;
+        }
+    });
+    double wallTime = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+
+    ofstream csv(options.batchOut);
+    if (!csv) {
+        cout << "BATCH: could not write " << options.batchOut << endl;
+        return 1;
+    }
+    csv << "race,seed,turtle_max_speed,turtle_acceleration,hare_max_speed,hare_acceleration,red_time,yellow_time,green_time,kart,rank,time\n";
+    csv << setprecision(9);
+    for (size_t i = 0; i < raceCount; i++) {
+        const RaceConfig& config = configs[i];
+        for (size_t r = 0; r < results[i].size(); r++) {
+            const FinishResult& result = results[i][r];
+            csv << i << ',' << config.seed << ','
+                << config.turtleMaxSpeed << ',' << config.turtleAcceleration << ','
+                << config.hareMaxSpeed << ',' << config.hareAcceleration << ','
+                << config.redTime << ',' << config.yellowTime << ',' << config.greenTime << ','
+                << result.name << ',';
+            if (result.rank > 0) {
+                csv << result.rank << ',' << result.time << '\n';
             }
             else {
-                end();
+                csv << "DNF,\n";
             }
-
         }
     }
-};
 
-class FinishLine : public Model3D {
-private:
-    int rank = 0;
-    bool playerFinished = false;
-public:
-    FinishLine(VAO* newModelVao, Texture* newTexture, Shader* newShader) {
-        modelVAO = newModelVao;
-        texture = newTexture;
-        modelShader = newShader;
-        identity_matrix = mat4(1.0f);
-        transparency = 1.0f;
-        rank = 0;
-        playerFinished = false;
+    cout << "BATCH: Races : " << raceCount << " : Threads : " << pool.getWorkerCount()
+        << " : Wall Time : " << wallTime << "s : Races/s : " << (wallTime > 0.0 ? raceCount / wallTime : 0.0) << endl;
+    cout << "BATCH: Results written to " << options.batchOut << endl;
+    if (!options.tracePath.empty()) {
+        saveTrace(options.tracePath, nullptr);
     }
-    bool CollisionCheck(Model3D* entity) {
-        if ((entity->getPos().z + entity->getScale().z)>=pos.z) {
-            Kart* kart=dynamic_cast<Kart*>(entity);
-            if (kart->getActivation()) {
-                PlayerKart* player = dynamic_cast<PlayerKart*>(entity);
-                if (player == nullptr) {
-                    kart->toggleActivation();
-                    kart->setEndTime(glfwGetTime());
-                    rank++;
-                    cout << "RANK: " << rank << " ";
-                    kart->printTime();
-                }
-                else if (!playerFinished){
-                    playerFinished = true;
-                    kart->setEndTime(glfwGetTime());
-                    rank++;
-                    cout << "RANK: " << rank << " ";
-                    kart->printTime();
-                }
-            }
-            return true;
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    TRACE_THREAD_NAME("Main Thread");
+    LaunchOptions options;
+    if (!parseLaunchOptions(argc, argv, options)) return -1;
+    if (options.batchRaces > 0) return runBatch(options);
+    if (options.headless) return runHeadless(options);
+
+    auto launchTime = chrono::steady_clock::now();
+
+    // The script replaces the mouse and keyboard, it is loaded before any window so a bad script fails fast
+    BenchmarkScript* benchmark = nullptr;
+    if (!options.benchmarkScript.empty()) {
+        benchmark = new BenchmarkScript();
+        if (!benchmark->load(options.benchmarkScript)) {
+            delete benchmark;
+            return -1;
+        }
+        if (benchmark->getFrames() > 0) {
+            options.frames = benchmark->getFrames();
         }
-        return false;
     }
-};
 
-int main(void)
-{
-    GLFWwindow* window;
-    if (!glfwInit()) return -1;
+    // Exactly one of these is set, offscreen runs have no window or glfw events
+    GLFWwindow* window = nullptr;
+    OffscreenContext* offscreen = nullptr;
 
     bool countdown1, countdown2, countdown3, gameEnd;
     countdown1 = countdown2 = countdown3 = gameEnd = false;
@@ -1615,21 +6218,31 @@ int main(void)
     float windowWidth = 700.f;
     float windowHeight = 700.f;
 
-    bool playerFinished = false;
-    bool ghost1Finished = false;
-    bool ghost2Finished = false;
-
-    window = glfwCreateWindow(700, 700, "GDGRAP1-MP | Chen-Elomina | Karting | ESC to close program", NULL, NULL);
-    if (!window)
-    {
-        glfwTerminate();
-        return -1;
+    if (options.offscreen) {
+        offscreen = new OffscreenContext((int)windowWidth, (int)windowHeight);
+        if (!offscreen->isValid()) {
+            delete offscreen;
+            return -1;
+        }
     }
+    else {
+        if (!glfwInit()) return -1;
+
+        window = glfwCreateWindow(700, 700, "GDGRAP1-MP | Chen-Elomina | Karting | ESC to close program", NULL, NULL);
+        if (!window)
+        {
+            glfwTerminate();
+            return -1;
+        }
 
-    glfwMakeContextCurrent(window);
-    glfwSetWindowPos(window, 960 - (windowWidth/2), 540 - (windowHeight / 2));
+        glfwMakeContextCurrent(window);
+        // Rendering is decoupled from the sim, so dropping vsync only changes how often frames are drawn.
+        // Benchmarks never wait on vsync, it would hide what the frame costs
+        glfwSwapInterval(options.uncapped || benchmark != nullptr ? 0 : 1);
+        glfwSetWindowPos(window, 960 - (windowWidth/2), 540 - (windowHeight / 2));
 
-    gladLoadGL();
+        gladLoadGL();
+    }
 
     /* Screen Space is usually:
         From 0 to screen width
@@ -1639,21 +6252,43 @@ int main(void)
     glViewport(0, 0, windowWidth, windowHeight);
 
     /* ====================================================== INITIALIZATION ====================================================== */
-    glfwSetKeyCallback(window, getUserInput);
-    glfwSetScrollCallback(window, scroll_callback);
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    if (window != nullptr && benchmark == nullptr) {
+        glfwSetKeyCallback(window, getUserInput);
+        glfwSetScrollCallback(window, scroll_callback);
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    }
 
     // CAMERA STUFF
     PerspectiveCamera perspectiveCam(windowWidth, windowHeight);
 
+    // Camera and light uniform buffers shared by every shader
+    SceneUniforms sceneUniforms;
+
+    // Sorted draws, max depth matches the camera's far plane
+    RenderQueue renderQueue(10000.f);
+
+    // GPU time per pass and per shader, averaged over the last 120 frames
+    GpuProfiler* gpuProfiler = new GpuProfiler(120);
+    gpuProfiler->setCapture(!options.tracePath.empty());
+    renderQueue.setProfiler(gpuProfiler);
+
     // Create Shaders
     Shader* objectShader = new Shader("Shaders/objectShaderV.vert", "Shaders/objectShaderF.frag");
     Shader* solidColorShader = new Shader("Shaders/solidColorShaderV.vert", "Shaders/solidColorShaderF.frag");
     Shader* landmarkShader = new Shader("Shaders/NormalMap.vert", "Shaders/NormalMap.frag");
+    Shader* instancedObjectShader = new Shader("Shaders/objectShaderInstancedV.vert", "Shaders/objectShaderF.frag");
 
-    // Sky Box
-    Skybox night("Shaders/skybox.vert", "Shaders/skybox.frag", "evening");
-    Skybox morning("Shaders/skybox.vert", "Shaders/skybox.frag", "day");
+    // Images are decoded off the main thread and trickle in over the first frames
+    TextureStreamer* textureStreamer = new TextureStreamer();
+
+    // Sky Box, one program and cube for both cubemaps. The one in view streams first, the other is prefetched behind it
+    Shader* skyboxShader = new Shader("Shaders/skybox.vert", "Shaders/skybox.frag");
+    Skybox skybox(skyboxShader);
+    CubemapManager* cubemaps = new CubemapManager(*textureStreamer, 64 * 1024 * 1024);
+    cubemaps->add("day", "Skybox/Morning/");
+    cubemaps->add("evening", "Skybox/Night/");
+    cubemaps->prefetch(day ? "day" : "evening");
+    cubemaps->prefetch(day ? "evening" : "day");
 
     // Create a VAOs
     VAO* planeVAO = new VAO("3D/plane.obj");
@@ -1661,14 +6296,22 @@ int main(void)
     VAO* artifactVAO = new VAO("3D/artifact.obj");
     VAO* ballVAO = new VAO("3D/ball.obj");
 
+    planeVAO->printStats();
+    spaceCarVAO->printStats();
+    artifactVAO->printStats();
+    ballVAO->printStats();
+
+    // Every kart shares the car mesh, so they are drawn with one instanced call
+    spaceCarVAO->enableInstancing();
+
     //Create Textures
-    Texture* planeTex = new Texture("3D/mercury.jpg",2);
-    Texture* spaceCarTex = new Texture("3D/spaceCarTexture.png",3);
-    Texture* artifactTex = new Texture("3D/artifact.png",4);
+    Texture* planeTex = new Texture("3D/mercury.jpg", 2, *textureStreamer);
+    Texture* spaceCarTex = new Texture("3D/spaceCarTexture.png", 3, *textureStreamer);
+    Texture* artifactTex = new Texture("3D/artifact.png", 4, *textureStreamer);
 
     //Normal Map
-    NormalMapTexture* earthTex = new NormalMapTexture("3D/earth_normal.png", 5, "3D/earth.png", 6);
-    NormalMapTexture* meteoriteTex = new NormalMapTexture("3D/meteorite_normal.png", 7, "3D/meteorite.png", 8);
+    NormalMapTexture* earthTex = new NormalMapTexture("3D/earth_normal.png", 5, "3D/earth.png", 6, *textureStreamer);
+    NormalMapTexture* meteoriteTex = new NormalMapTexture("3D/meteorite_normal.png", 7, "3D/meteorite.png", 8, *textureStreamer);
 
     // Create 3D Models.
 
@@ -1680,13 +6323,6 @@ int main(void)
     plane.setThetaX(90.f);
     plane.setPosY(-0.25f);
 
-    // Finish Line
-    FinishLine finishLine(planeVAO, planeTex, solidColorShader);
-    finishLine.setPosY(1.85f);
-    finishLine.setPosZ(400.0f);
-    finishLine.setScaleX(40.0f);
-    finishLine.setScaleY(0.1f);
-
     //landmarks
     NormalMapModel earth(ballVAO, earthTex, landmarkShader);
     NormalMapModel meteorite(ballVAO,meteoriteTex,landmarkShader);
@@ -1699,44 +6335,62 @@ int main(void)
     earth.setPosZ(75);
     earth.setPosX(-40.f);
 
-
-    // Karts
-    PlayerKart playerSpaceCar(spaceCarVAO, spaceCarTex, objectShader, "Player", 0.035f, 0.00005f);
-    playerSpaceCar.setPosY(2.0f);
-    playerSpaceCar.setPosZ(-3.0f);
-    playerSpaceCar.setSize(0.25f);
-    Kart ghost1(spaceCarVAO, spaceCarTex, objectShader, "Turtle", 0.04f, 0.00006f); // Faster
-    ghost1.setTransparency(0.1f);
-    ghost1.setSize(0.25f);
-    ghost1.setPosY(2.0f);
-    ghost1.setPosZ(-2.8f);
-    ghost1.setPosX(2.25f);
-    Kart ghost2(spaceCarVAO, spaceCarTex, objectShader, "Hare", 0.033f, 0.000045f); // Slower
-    ghost2.setTransparency(0.1f);
-    ghost2.setSize(0.25f);
-    ghost2.setPosY(2.0f);
-    ghost2.setPosZ(-2.0f);
-    ghost2.setPosX(-2.25f);
+    // Landmarks are lit by landmarkLight, see sceneLights
+    meteorite.setPointLightIndex(1);
+    earth.setPointLightIndex(1);
+
+
+    // Karts, traffic light and finish line
+    RaceAssets raceAssets;
+    raceAssets.planeVAO = planeVAO;
+    raceAssets.spaceCarVAO = spaceCarVAO;
+    raceAssets.artifactVAO = artifactVAO;
+    raceAssets.planeTex = planeTex;
+    raceAssets.spaceCarTex = spaceCarTex;
+    raceAssets.artifactTex = artifactTex;
+    raceAssets.objectShader = objectShader;
+    raceAssets.solidColorShader = solidColorShader;
+    RaceConfig raceConfig;
+    raceConfig.aiKarts = options.aiKarts;
+    raceConfig.replayPath = options.replayPath;
+    raceConfig.simRate = options.simRate;
+    Race race(raceAssets, raceConfig);
+
+    bool recording = !options.recordPath.empty();
+    ReplayRecorder recorder(options.simRate);
+
+    PlayerKart& playerSpaceCar = race.getPlayer();
+    Kart& ghost1 = race.getGhost1();
+    Kart& ghost2 = race.getGhost2();
+    TrafficLight& trafficLight = race.getTrafficLight();
+    FinishLine& finishLine = race.getFinishLine();
+
+    playerSpaceCar.setInstancedShader(instancedObjectShader);
+    ghost1.setInstancedShader(instancedObjectShader);
+    ghost2.setInstancedShader(instancedObjectShader);
+    for (size_t i = 0; i < race.getAIKarts().size(); i++) {
+        race.getAIKarts()[i]->setInstancedShader(instancedObjectShader);
+    }
+    if (race.getReplayKart() != nullptr) {
+        race.getReplayKart()->setInstancedShader(instancedObjectShader);
+    }
 
     //LIGHT STUFF
-    PointLight pointLight;
     PointLight landmarkLight;
     landmarkLight.setLumens(500.f);
 
-    TrafficLight trafficLight(artifactVAO, artifactTex, objectShader, &pointLight);
-    trafficLight.setTransparency(1.0f);
-    trafficLight.setSize(30.f);
-    trafficLight.setPosY(200.0f);
-    trafficLight.setPosZ(400.0f);
-    trafficLight.setRedTime(2.5);
-    trafficLight.setYellowTime(4.0);
-    trafficLight.setGreenTime(3.5);
-
     DirectionLight directionLight(vec3(4.0f, 5.0f, 3.0f));
     directionLight.setPosX(0.0f);
     directionLight.setPosY(-5.0f);
     directionLight.setPosZ(0.0f);
 
+    // Order matches the models' point light index
+    PointLight* sceneLights[] = { &race.getTrafficPointLight(), &landmarkLight };
+
+    // Landmarks are the props karts can run into
+    race.addProp(&earth, ballVAO->getBoundingRadius() * earth.getScale().x);
+    race.addProp(&meteorite, ballVAO->getBoundingRadius() * meteorite.getScale().x);
+
     //Set the Kart as the parent of Camera
     perspectiveCam.attachParent(&playerSpaceCar);
 
@@ -1748,81 +6402,126 @@ int main(void)
     glBlendEquation(GL_FUNC_ADD);
 
 
-    while (!glfwWindowShouldClose(window))
-    {
-        /* =========================== UPDATES AND INPUTS =========================== */
+    FixedTimestep timestep(options.simRate);
+    bool firstFrame = true;
 
-        if (!trafficLight.getStart() && glfwGetTime() > 6.0) {
-            trafficLight.start();
+    /* Offscreen and benchmark frames are a fixed 1/60s apart whatever they cost to draw, and start once every
+    *  texture is in, so the same options always draw the same frames
+    */
+    const double OFFSCREEN_FRAME_STEP = 1.0 / 60.0;
+    bool fixedFrames = offscreen != nullptr || benchmark != nullptr;
+    size_t frameIndex = 0;
+    bool offscreenDone = false;
+    BenchmarkRecorder benchmarkRecorder;
+    if (fixedFrames) {
+        while (!textureStreamer->isIdle()) {
+            textureStreamer->update(1000.0);
+            this_thread::sleep_for(chrono::milliseconds(1));
         }
+    }
+    auto loopStart = chrono::steady_clock::now();
+    // The window's clock starts at glfwInit
+    auto getFrameTime = [&]() {
+        return fixedFrames ? frameIndex * OFFSCREEN_FRAME_STEP : glfwGetTime();
+    };
 
-        //Get User Input
-        perspectiveCam.getInputs(window);
-        playerSpaceCar.getUserInput(window);
+    while (fixedFrames ? (frameIndex < options.frames && !offscreenDone) : !glfwWindowShouldClose(window))
+    {
+        TRACE_SCOPE("Frame");
+        auto frameStart = chrono::steady_clock::now();
 
-        //Update
-        if (stopCars == false) {
-            ghost1.setAcceleration(0.00006f);
-            ghost2.setAcceleration(0.00004f);
+        /* =========================== UPDATES AND INPUTS =========================== */
+
+        //Camera input is per frame, everything that moves is stepped in fixed sim ticks
+        if (benchmark != nullptr) {
+            BenchmarkScript::Event event;
+            while (benchmark->popEvent(getFrameTime(), event)) {
+                if (event.type == BenchmarkScript::EVENT_STOP_CARS) {
+                    stopCarsToggled = true;
+                }
+                else {
+                    day = event.type == BenchmarkScript::EVENT_DAY;
+                }
+            }
+            float thetaX, thetaY, zoom;
+            if (benchmark->getCamera(getFrameTime(), thetaX, thetaY, zoom)) {
+                perspectiveCam.setOrbit(thetaX, thetaY);
+                perspectiveCameraZoom = zoom;
+            }
         }
-        else {
-            ghost1.setAcceleration(0.0f);
-            ghost2.setAcceleration(0.0f);
-            ghost1.setSpeed(0.0f);
-            ghost2.setSpeed(0.0f);
+        else if (window != nullptr) {
+            perspectiveCam.getInputs(window);
         }
 
-        ghost1.update();
-        ghost2.update();
-
-        playerSpaceCar.update();
+        if (stopCarsToggled) {
+            race.toggleStopCars();
+            stopCarsToggled = false;
+        }
 
-        perspectiveCam.setZoom(perspectiveCameraZoom);
-        perspectiveCam.update(windowWidth, windowHeight);
+        timestep.beginFrame(getFrameTime());
+        while (timestep.consumeTick()) {
+            TRACE_SCOPE("Sim Tick");
+            //Get User Input and Update, nobody drives offscreen unless a benchmark script does
+            KartInput input;
+            if (benchmark != nullptr) {
+                input = benchmark->getInput(timestep.getSimTime());
+            }
+            else if (window != nullptr) {
+                input = pollKartInput(window);
+            }
+            race.tick(timestep.getSimTime(), input);
+            if (recording) {
+                recordPlayer(recorder, race);
+            }
 
-        trafficLight.update(glfwGetTime());
-        if (trafficLight.getGreenLight()&&!raceStarted) {
-            playerSpaceCar.toggleActivation();
-            ghost1.toggleActivation();
-            ghost2.toggleActivation();
-            raceStarted = true;
-            stopCars = false;
+            earth.saveState();
+            meteorite.saveState();
+            float tickScale = (float)(SIM_REFERENCE_RATE / options.simRate);
+            earth.update(tickScale);
+            meteorite.update(tickScale);
         }
+        float simInterpolation = timestep.getInterpolation();
 
-        earth.update();
-        meteorite.update();
-
-        playerFinished = finishLine.CollisionCheck(&playerSpaceCar);
-        ghost1Finished = finishLine.CollisionCheck(&ghost1);
-        ghost2Finished = finishLine.CollisionCheck(&ghost2);
+        perspectiveCam.setZoom(perspectiveCameraZoom);
+        perspectiveCam.update(windowWidth, windowHeight, simInterpolation);
 
         /* =========================== RENDER =========================== */
+        // A couple of milliseconds a frame for texture uploads
+        textureStreamer->update(2.0);
+
+        gpuProfiler->beginFrame();
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        
-        //Draw the models
+
         if (day) {
-            morning.draw(perspectiveCam);
             vec3 cottonCandyPink(242, 153, 205);
             directionLight.setRGB(cottonCandyPink);
             directionLight.setLumens(3.0f);
         }else{
-            night.draw(perspectiveCam);
             vec3 mikuTeal(9, 179, 130);
             directionLight.setRGB(mikuTeal);
             directionLight.setLumens(1.25f);
         }
 
+        // Camera and lights are captured once, every draw below reads from this frame
+        const FrameContext frame(perspectiveCam, sceneLights, 2, directionLight, getFrameTime(), simInterpolation);
+        sceneUniforms.upload(frame);
+
+        //Draw the models
+        gpuProfiler->beginScope("Skybox");
+        skybox.draw(cubemaps->acquire(day ? "day" : "evening"));
+        gpuProfiler->endScope();
+
         //If all karts past finish line
-        if (playerFinished && ghost1Finished && ghost2Finished) {
+        if (race.isFinished()) {
             
             if (!gameEnd) {
                 cout << endl <<"Thank You For Playing!" << endl <<endl;
                 cout << "Game Will Now Close in..." << endl;
                 gameEnd = true;
-                startCountdownTime = glfwGetTime();  // Start countdown
+                startCountdownTime = getFrameTime();  // Start countdown
             }
 
-            double currentTime = glfwGetTime();  // Get the current time
+            double currentTime = getFrameTime();  // Get the current time
             double elapsedTime = currentTime - startCountdownTime;  // Time elapsed since game ended
 
             if (elapsedTime >= 1.0 && elapsedTime < 2.0) {
@@ -1845,34 +6544,109 @@ int main(void)
             }
             else if (elapsedTime >= 4.0) {
                 cout << "0" << endl;
-                glfwSetWindowShouldClose(window, GL_TRUE);  // Close the window after the countdown
+                // Close the window after the countdown
+                if (fixedFrames) {
+                    offscreenDone = true;
+                }
+                else {
+                    glfwSetWindowShouldClose(window, GL_TRUE);
+                }
             }
         }
 
-        plane.draw(perspectiveCam, pointLight, directionLight);
-        finishLine.draw(perspectiveCam, pointLight, directionLight);
-        
-        trafficLight.draw(perspectiveCam, pointLight, directionLight);
-        playerSpaceCar.draw(perspectiveCam, pointLight, directionLight);
-        ghost1.draw(perspectiveCam, pointLight, directionLight);
-        ghost2.draw(perspectiveCam, pointLight, directionLight);
-        meteorite.draw(perspectiveCam, landmarkLight, directionLight);
-        earth.draw(perspectiveCam, landmarkLight, directionLight);
-
-        /*jupiter.draw(perspectiveCam, pointLight, directionLight);
-        mars.draw(perspectiveCam, pointLight, directionLight);*/
+        renderQueue.submit(&plane, frame);
+        renderQueue.submit(&finishLine, frame);
+        renderQueue.submit(&trafficLight, frame);
+        renderQueue.submit(&playerSpaceCar, frame);
+        renderQueue.submit(&ghost1, frame);
+        renderQueue.submit(&ghost2, frame);
+        for (size_t i = 0; i < race.getAIKarts().size(); i++) {
+            renderQueue.submit(race.getAIKarts()[i].get(), frame);
+        }
+        if (race.getReplayKart() != nullptr) {
+            renderQueue.submit(race.getReplayKart(), frame);
+        }
+        renderQueue.submit(&meteorite, frame);
+        renderQueue.submit(&earth, frame);
+        renderQueue.execute(frame);
+        gpuProfiler->endFrame();
+
+        if (printRenderStats) {
+            renderQueue.printStats();
+            gpuProfiler->printStats();
+            race.getCollisionWorld().printStats();
+            cubemaps->printStats();
+            printRenderStats = false;
+        }
 
-        /* Swap front and back buffers */
-        glfwSwapBuffers(window);
+        if (offscreen != nullptr) {
+            if (!options.dumpDir.empty() && frameIndex % options.dumpEvery == 0) {
+                ostringstream framePath;
+                framePath << options.dumpDir << "/frame_" << setw(5) << setfill('0') << frameIndex << ".ppm";
+                if (!offscreen->savePPM(framePath.str())) {
+                    cout << "OFFSCREEN: could not write " << framePath.str() << endl;
+                }
+            }
+            // Stands in for the swap's flush, without it the GPU can sit on the frame and its timer queries
+            glFlush();
+        }
+        else {
+            TRACE_SCOPE("Swap");
+            /* Swap front and back buffers */
+            glfwSwapBuffers(window);
+        }
+        if (benchmark != nullptr) {
+            // Waiting on the GPU each frame makes the sample what this frame cost, not what the driver queued
+            glFinish();
+            benchmarkRecorder.addFrame(chrono::duration<double, milli>(chrono::steady_clock::now() - frameStart).count(), renderQueue.getStats());
+        }
+        if (fixedFrames) {
+            frameIndex++;
+        }
+        if (firstFrame) {
+            cout << "STARTUP: First frame after : " << chrono::duration<double>(chrono::steady_clock::now() - launchTime).count() << "s" << endl;
+            firstFrame = false;
+        }
 
         /* Poll for and process events */
-        glfwPollEvents();
+        if (window != nullptr) {
+            glfwPollEvents();
+        }
+    }
+    if (offscreen != nullptr) {
+        // Reading back waits for the last frame, so the wall time covers all of the rendering
+        glFinish();
+        double wallTime = chrono::duration<double>(chrono::steady_clock::now() - loopStart).count();
+        cout << "OFFSCREEN: Frames : " << frameIndex << " : Wall Time : " << wallTime << "s"
+            << " : Avg Frame : " << (frameIndex > 0 ? wallTime * 1000.0 / frameIndex : 0.0) << "ms" << endl;
+        renderQueue.printStats();
+        gpuProfiler->printStats();
+    }
+    if (benchmark != nullptr) {
+        benchmarkRecorder.print();
+        if (benchmarkRecorder.write(options.benchmarkOut, options.benchmarkScript)) {
+            cout << "BENCHMARK: wrote " << options.benchmarkOut << endl;
+        }
+        else {
+            cout << "BENCHMARK: could not write " << options.benchmarkOut << endl;
+        }
+        delete benchmark;
     }
     /* =========================== CLEAN UP =========================== */
+    if (recording) {
+        saveRecording(recorder, options.recordPath);
+    }
+    if (!options.tracePath.empty()) {
+        saveTrace(options.tracePath, gpuProfiler);
+    }
+    delete gpuProfiler;
+
     //Delete Shaders
     delete objectShader;
     delete solidColorShader;
     delete landmarkShader;
+    delete instancedObjectShader;
+    delete skyboxShader;
 
 
     //Delete VAOs
@@ -1881,13 +6655,20 @@ int main(void)
     delete artifactVAO;
     delete ballVAO;
 
-    //Delete Textures
+    //Delete Textures, pending uploads are dropped with the streamer
+    delete cubemaps;
+    delete textureStreamer;
     delete artifactTex;
     delete spaceCarTex;
     delete planeTex;
     delete earthTex;
     delete meteoriteTex;
 
-    glfwTerminate();
+    if (offscreen != nullptr) {
+        delete offscreen;
+    }
+    else {
+        glfwTerminate();
+    }
     return 0;
 };
\ No newline at end of file